@@ -0,0 +1,724 @@
+/*
+ * AES-128/256-GCM (FIPS-197, NIST SP 800-38D) with 96 bit IVs.
+ * With AES-NI and PCLMULQDQ the counter mode runs 8 blocks per step and
+ * GHASH folds 4 blocks per reduction. Without them everything is constant
+ * time: SubBytes is the Boyar-Peralta circuit bitsliced over 4 blocks and
+ * GHASH multiplies with masks, so nothing indexes a table by secret data.
+ * The key schedule is the software one on both paths.
+ */
+#include "cipher.hpp"
+#include "cpu.hpp"
+
+namespace luke {
+
+static inline b8 load_le64(const b1 *p) {
+  b8 v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static inline void store_le64(b1 *p, b8 v) {
+  for (int i = 0; i < 8; i++, v >>= 8)
+    p[i] = (b1)v;
+}
+
+static inline b8 load_be64(const b1 *p) {
+  b8 v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static inline void store_be64(b1 *p, b8 v) {
+  for (int i = 7; i >= 0; i--, v >>= 8)
+    p[i] = (b1)v;
+}
+
+static inline void store_be32(b1 *p, b4 v) {
+  p[0] = (b1)(v >> 24);
+  p[1] = (b1)(v >> 16);
+  p[2] = (b1)(v >> 8);
+  p[3] = (b1)v;
+}
+
+/* 8x8 bit matrix transpose: bit c of byte r <-> bit r of byte c */
+static inline b8 transpose8(b8 x) {
+  b8 t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+/*
+ * The AES S-box on bit planes, q[k] is bit k of 64 bytes. Boyar and
+ * Peralta, "A new combinational logic minimization technique with
+ * applications to cryptology"; x0 is the high bit.
+ */
+static void sbox_planes(b8 *q) {
+  b8 x0, x1, x2, x3, x4, x5, x6, x7;
+  b8 y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  b8 y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  b8 y20, y21;
+  b8 z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  b8 z10, z11, z12, z13, z14, z15, z16, z17;
+  b8 t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  b8 t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  b8 t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  b8 t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  b8 t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  b8 t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  b8 t60, t61, t62, t63, t64, t65, t66, t67;
+  b8 s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  /* top linear transformation */
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  /* non-linear section */
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  /* bottom linear transformation */
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+/* 64 bytes to bit planes, bit i of q[k] is bit k of byte i */
+static void to_planes(const b1 *s, b8 q[8]) {
+  b8 t[8];
+  int g, k;
+
+  for (g = 0; g < 8; g++)
+    t[g] = transpose8(load_le64(s + g * 8));
+  for (k = 0; k < 8; k++) {
+    q[k] = 0;
+    for (g = 0; g < 8; g++)
+      q[k] |= ((t[g] >> (8 * k)) & 0xFF) << (8 * g);
+  }
+}
+
+static void from_planes(const b8 q[8], b1 *s) {
+  b8 t;
+  int g, k;
+
+  for (g = 0; g < 8; g++) {
+    t = 0;
+    for (k = 0; k < 8; k++)
+      t |= ((q[k] >> (8 * g)) & 0xFF) << (8 * k);
+    store_le64(s + g * 8, transpose8(t));
+  }
+}
+
+/* SubBytes over 64 bytes, for the key schedule */
+static void sub_bytes64(b1 *s) {
+  b8 q[8];
+
+  to_planes(s, q);
+  sbox_planes(q);
+  from_planes(q, s);
+}
+
+/*
+ * Each 16 bit lane of a plane is one block, bit r + 4c is row r of
+ * column c.
+ */
+static void shift_rows_planes(b8 *q) {
+  for (int k = 0; k < 8; k++) {
+    b8 x = q[k];
+    q[k] = (x & 0x1111111111111111ULL) |
+           ((x >> 4) & 0x0222022202220222ULL) |
+           ((x << 12) & 0x2000200020002000ULL) |
+           ((x >> 8) & 0x0044004400440044ULL) |
+           ((x << 8) & 0x4400440044004400ULL) |
+           ((x >> 12) & 0x0008000800080008ULL) |
+           ((x << 4) & 0x8880888088808880ULL);
+  }
+}
+
+/* row r takes row r + 1 of the same column */
+static inline b8 rot_rows1(b8 x) {
+  return ((x >> 1) & 0x7777777777777777ULL) |
+         ((x << 3) & 0x8888888888888888ULL);
+}
+
+static inline b8 rot_rows2(b8 x) {
+  return ((x >> 2) & 0x3333333333333333ULL) |
+         ((x << 2) & 0xCCCCCCCCCCCCCCCCULL);
+}
+
+/* b_r = 2 (a_r + a_r+1) + a_r+1 + a_r+2 + a_r+3 */
+static void mix_columns_planes(b8 *q) {
+  b8 t[8], s[8];
+  int k;
+
+  for (k = 0; k < 8; k++) {
+    t[k] = q[k] ^ rot_rows1(q[k]);
+    s[k] = q[k] ^ t[k] ^ rot_rows2(t[k]);
+  }
+  q[0] = s[0] ^ t[7];
+  q[1] = s[1] ^ t[0] ^ t[7];
+  q[2] = s[2] ^ t[1];
+  q[3] = s[3] ^ t[2] ^ t[7];
+  q[4] = s[4] ^ t[3] ^ t[7];
+  q[5] = s[5] ^ t[4];
+  q[6] = s[6] ^ t[5];
+  q[7] = s[7] ^ t[6];
+}
+
+static inline void add_round_key(b8 *q, const b8 *rk) {
+  for (int k = 0; k < 8; k++)
+    q[k] ^= rk[k];
+}
+
+/* encrypts 4 blocks in place */
+static void aes_encrypt4_ct(const AES_GCM_CTX *ctx, b1 *s) {
+  b8 q[8];
+  int r;
+
+  to_planes(s, q);
+  add_round_key(q, ctx->rkp[0]);
+  for (r = 1; r < ctx->rounds; r++) {
+    sbox_planes(q);
+    shift_rows_planes(q);
+    mix_columns_planes(q);
+    add_round_key(q, ctx->rkp[r]);
+  }
+  sbox_planes(q);
+  shift_rows_planes(q);
+  add_round_key(q, ctx->rkp[ctx->rounds]);
+  from_planes(q, s);
+}
+
+static void key_expansion(AES_GCM_CTX *ctx, const b1 *key, int keyLen) {
+  static const b1 rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10,
+                              0x20, 0x40, 0x80, 0x1B, 0x36};
+  b1 w[60][4];
+  b1 sb[64];
+  int nk = keyLen / 4, total, i, j;
+
+  ctx->rounds = nk + 6;
+  total = 4 * (ctx->rounds + 1);
+  for (i = 0; i < nk; i++)
+    for (j = 0; j < 4; j++)
+      w[i][j] = key[4 * i + j];
+  for (i = nk; i < total; i++) {
+    b1 t[4] = {w[i - 1][0], w[i - 1][1], w[i - 1][2], w[i - 1][3]};
+    if (i % nk == 0 || (nk > 6 && i % nk == 4)) {
+      for (j = 0; j < 64; j++)
+        sb[j] = 0;
+      for (j = 0; j < 4; j++)
+        sb[j] = (i % nk == 0) ? t[(j + 1) % 4] : t[j];
+      sub_bytes64(sb);
+      for (j = 0; j < 4; j++)
+        t[j] = sb[j];
+      if (i % nk == 0)
+        t[0] ^= rcon[i / nk - 1];
+    }
+    for (j = 0; j < 4; j++)
+      w[i][j] = w[i - nk][j] ^ t[j];
+  }
+  for (i = 0; i < total; i++)
+    for (j = 0; j < 4; j++)
+      ctx->rk[i / 4][(i % 4) * 4 + j] = w[i][j];
+  /* the same round key in all 4 lanes */
+  for (i = 0; i <= ctx->rounds; i++) {
+    for (j = 0; j < 64; j++)
+      sb[j] = ctx->rk[i][j % 16];
+    to_planes(sb, ctx->rkp[i]);
+  }
+}
+
+/* counter blocks are the IV and a 32 bit big endian counter */
+static void ctr_ct(const AES_GCM_CTX *ctx, const b1 iv[12], b4 ctr,
+                   const b1 *in, b1 *out, size_t len) {
+  b1 ks[64];
+  size_t i;
+  int b;
+
+  while (len > 0) {
+    size_t n = len < 64 ? len : 64;
+    for (b = 0; b < 4; b++) {
+      for (i = 0; i < 12; i++)
+        ks[b * 16 + i] = iv[i];
+      store_be32(ks + b * 16 + 12, ctr + b);
+    }
+    aes_encrypt4_ct(ctx, ks);
+    for (i = 0; i < n; i++)
+      out[i] = in[i] ^ ks[i];
+    ctr += 4;
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+
+/*
+ * Carry-less 64 x 64 multiply, low half, with integer multiplies: every
+ * fourth bit is kept so the carries fall into the holes and are masked off.
+ * Pornin, BearSSL ghash_ctmul64.
+ */
+static inline b8 bmul64(b8 x, b8 y) {
+  const b8 m0 = 0x1111111111111111ULL, m1 = 0x2222222222222222ULL;
+  const b8 m2 = 0x4444444444444444ULL, m3 = 0x8888888888888888ULL;
+  b8 x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+  b8 y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+  b8 z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+  b8 z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+  b8 z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+  b8 z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+  return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static inline b8 rev64(b8 x) {
+  x = ((x & 0x5555555555555555ULL) << 1) | ((x >> 1) & 0x5555555555555555ULL);
+  x = ((x & 0x3333333333333333ULL) << 2) | ((x >> 2) & 0x3333333333333333ULL);
+  x = ((x & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  x = ((x & 0x0000FFFF0000FFFFULL) << 16) |
+      ((x >> 16) & 0x0000FFFF0000FFFFULL);
+  return (x << 32) | (x >> 32);
+}
+
+/* y = (y + block) H for the 16 byte blocks of data, the last zero padded */
+static void ghash_blocks_ct(b1 y[16], const b1 h[16], const b1 *data,
+                            size_t len) {
+  b8 y1 = load_be64(y), y0 = load_be64(y + 8);
+  b8 h1 = load_be64(h), h0 = load_be64(h + 8);
+  b8 h0r = rev64(h0), h1r = rev64(h1);
+  b8 h2 = h0 ^ h1, h2r = h0r ^ h1r;
+
+  while (len > 0) {
+    b1 tmp[16] = {0};
+    const b1 *src = data;
+    size_t n = len < 16 ? len : 16;
+    if (n < 16) {
+      for (size_t i = 0; i < n; i++)
+        tmp[i] = data[i];
+      src = tmp;
+    }
+    data += n;
+    len -= n;
+
+    y1 ^= load_be64(src);
+    y0 ^= load_be64(src + 8);
+    b8 y0r = rev64(y0), y1r = rev64(y1);
+    b8 y2 = y0 ^ y1, y2r = y0r ^ y1r;
+
+    /* karatsuba, the reversed products give the high halves */
+    b8 z0 = bmul64(y0, h0), z1 = bmul64(y1, h1), z2 = bmul64(y2, h2);
+    b8 z0h = bmul64(y0r, h0r), z1h = bmul64(y1r, h1r);
+    b8 z2h = bmul64(y2r, h2r);
+    z2 ^= z0 ^ z1;
+    z2h ^= z0h ^ z1h;
+    z0h = rev64(z0h) >> 1;
+    z1h = rev64(z1h) >> 1;
+    z2h = rev64(z2h) >> 1;
+
+    b8 v0 = z0, v1 = z0h ^ z2, v2 = z1 ^ z2h, v3 = z1h;
+    v3 = (v3 << 1) | (v2 >> 63);
+    v2 = (v2 << 1) | (v1 >> 63);
+    v1 = (v1 << 1) | (v0 >> 63);
+    v0 = (v0 << 1);
+
+    v2 ^= v0 ^ (v0 >> 1) ^ (v0 >> 2) ^ (v0 >> 7);
+    v1 ^= (v0 << 63) ^ (v0 << 62) ^ (v0 << 57);
+    v3 ^= v1 ^ (v1 >> 1) ^ (v1 >> 2) ^ (v1 >> 7);
+    v2 ^= (v1 << 63) ^ (v1 << 62) ^ (v1 << 57);
+    y0 = v2;
+    y1 = v3;
+  }
+  store_be64(y, y1);
+  store_be64(y + 8, y0);
+}
+
+static void ghash_ct(const AES_GCM_CTX *ctx, const b1 *aad, size_t aadLen,
+                     const b1 *data, size_t len, b1 y[16]) {
+  b1 lens[16];
+
+  for (int i = 0; i < 16; i++)
+    y[i] = 0;
+  ghash_blocks_ct(y, ctx->H, aad, aadLen);
+  ghash_blocks_ct(y, ctx->H, data, len);
+  /* the associated data and the data lengths in bits */
+  store_be64(lens, (b8)aadLen * 8);
+  store_be64(lens + 8, (b8)len * 8);
+  ghash_blocks_ct(y, ctx->H, lens, 16);
+}
+
+#ifdef LUKE_X86
+static inline b4 bswap32(b4 x) {
+  return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+AESNI_TARGET static inline __m128i bswap128(__m128i x) {
+  return _mm_shuffle_epi8(
+      x, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+/*
+ * carry-less a * b on byte reversed values, without the reduction, so
+ * several products can be added up and reduced once
+ */
+AESNI_TARGET static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo,
+                                          __m128i *hi) {
+  __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+  __m128i t1 = _mm_clmulepi64_si128(a, b, 0x10);
+  __m128i t2 = _mm_clmulepi64_si128(a, b, 0x01);
+  __m128i t3 = _mm_clmulepi64_si128(a, b, 0x11);
+  t1 = _mm_xor_si128(t1, t2);
+  *lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+  *hi = _mm_xor_si128(*hi, _mm_xor_si128(t3, _mm_srli_si128(t1, 8)));
+}
+
+/* shift the 256 bit product left by one for the bit reflection, reduce */
+AESNI_TARGET static inline __m128i gf_reduce(__m128i lo, __m128i hi) {
+  __m128i t7, t8, t9, t2, t4, t5;
+
+  t7 = _mm_srli_epi32(lo, 31);
+  t8 = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  lo = _mm_or_si128(lo, t7);
+  hi = _mm_or_si128(hi, t8);
+  hi = _mm_or_si128(hi, t9);
+
+  t7 = _mm_slli_epi32(lo, 31);
+  t8 = _mm_slli_epi32(lo, 30);
+  t9 = _mm_slli_epi32(lo, 25);
+  t7 = _mm_xor_si128(t7, t8);
+  t7 = _mm_xor_si128(t7, t9);
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  lo = _mm_xor_si128(lo, t7);
+  t2 = _mm_srli_epi32(lo, 1);
+  t4 = _mm_srli_epi32(lo, 2);
+  t5 = _mm_srli_epi32(lo, 7);
+  t2 = _mm_xor_si128(t2, t4);
+  t2 = _mm_xor_si128(t2, t5);
+  t2 = _mm_xor_si128(t2, t8);
+  lo = _mm_xor_si128(lo, t2);
+  return _mm_xor_si128(hi, lo);
+}
+
+AESNI_TARGET static inline __m128i gf_mul(__m128i a, __m128i b) {
+  __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+  clmul_acc(a, b, &lo, &hi);
+  return gf_reduce(lo, hi);
+}
+
+AESNI_TARGET static void hpow_ni(AES_GCM_CTX *ctx) {
+  __m128i h1 = bswap128(_mm_loadu_si128((const __m128i *)ctx->H));
+  __m128i h = h1;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    _mm_storeu_si128((__m128i *)ctx->Hpow[i], h);
+    h = gf_mul(h, h1);
+  }
+}
+
+AESNI_TARGET static void ghash_ni(const AES_GCM_CTX *ctx, const b1 *aad,
+                                  size_t aadLen, const b1 *data, size_t len,
+                                  b1 y[16]) {
+  const __m128i h1 = _mm_loadu_si128((const __m128i *)ctx->Hpow[0]);
+  const __m128i h2 = _mm_loadu_si128((const __m128i *)ctx->Hpow[1]);
+  const __m128i h3 = _mm_loadu_si128((const __m128i *)ctx->Hpow[2]);
+  const __m128i h4 = _mm_loadu_si128((const __m128i *)ctx->Hpow[3]);
+  const __m128i *p = (const __m128i *)data;
+  __m128i x = _mm_setzero_si128();
+  size_t total = len;
+
+  /* the associated data is a header, a block at a time will do */
+  for (size_t off = 0; off < aadLen; off += 16) {
+    b1 block[16] = {0};
+    for (size_t i = 0; i < 16 && off + i < aadLen; i++)
+      block[i] = aad[off + i];
+    x = gf_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((__m128i *)block))),
+               h1);
+  }
+  /* x = (x + c0) H^4 + c1 H^3 + c2 H^2 + c3 H */
+  while (len >= 64) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    clmul_acc(_mm_xor_si128(x, bswap128(_mm_loadu_si128(p))), h4, &lo, &hi);
+    clmul_acc(bswap128(_mm_loadu_si128(p + 1)), h3, &lo, &hi);
+    clmul_acc(bswap128(_mm_loadu_si128(p + 2)), h2, &lo, &hi);
+    clmul_acc(bswap128(_mm_loadu_si128(p + 3)), h1, &lo, &hi);
+    x = gf_reduce(lo, hi);
+    p += 4;
+    len -= 64;
+  }
+  while (len >= 16) {
+    x = gf_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128(p))), h1);
+    p++;
+    len -= 16;
+  }
+  if (len > 0) {
+    b1 last[16] = {0};
+    for (size_t i = 0; i < len; i++)
+      last[i] = ((const b1 *)p)[i];
+    x = gf_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((__m128i *)last))),
+               h1);
+  }
+  /* the associated data and the data lengths in bits */
+  x = gf_mul(_mm_xor_si128(x, _mm_set_epi64x((long long)(aadLen * 8),
+                                             (long long)(total * 8))),
+             h1);
+  _mm_storeu_si128((__m128i *)y, bswap128(x));
+}
+
+AESNI_TARGET static inline __m128i counter_block(__m128i base, b4 ctr) {
+  return _mm_insert_epi32(base, (int)bswap32(ctr), 3);
+}
+
+AESNI_TARGET static void ctr_ni(const AES_GCM_CTX *ctx, const b1 iv[12],
+                                b4 ctr, const b1 *in, b1 *out, size_t len) {
+  __m128i rk[15];
+  b1 ivb[16] = {0};
+  int r, i;
+
+  for (r = 0; r <= ctx->rounds; r++)
+    rk[r] = _mm_loadu_si128((const __m128i *)ctx->rk[r]);
+  for (i = 0; i < 12; i++)
+    ivb[i] = iv[i];
+  const __m128i base = _mm_loadu_si128((const __m128i *)ivb);
+
+  while (len >= 128) {
+    __m128i c[8];
+    for (i = 0; i < 8; i++)
+      c[i] = _mm_xor_si128(counter_block(base, ctr + i), rk[0]);
+    for (r = 1; r < ctx->rounds; r++)
+      for (i = 0; i < 8; i++)
+        c[i] = _mm_aesenc_si128(c[i], rk[r]);
+    for (i = 0; i < 8; i++) {
+      c[i] = _mm_aesenclast_si128(c[i], rk[ctx->rounds]);
+      _mm_storeu_si128(
+          (__m128i *)out + i,
+          _mm_xor_si128(c[i], _mm_loadu_si128((const __m128i *)in + i)));
+    }
+    ctr += 8;
+    in += 128;
+    out += 128;
+    len -= 128;
+  }
+  while (len > 0) {
+    size_t n = len < 16 ? len : 16;
+    b1 ks[16];
+    __m128i c = _mm_xor_si128(counter_block(base, ctr), rk[0]);
+    for (r = 1; r < ctx->rounds; r++)
+      c = _mm_aesenc_si128(c, rk[r]);
+    _mm_storeu_si128((__m128i *)ks, _mm_aesenclast_si128(c, rk[ctx->rounds]));
+    for (size_t k = 0; k < n; k++)
+      out[k] = in[k] ^ ks[k];
+    ctr++;
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+#endif /* LUKE_X86 */
+
+static void ctr_xor(const AES_GCM_CTX *ctx, const b1 iv[12], b4 ctr,
+                    const b1 *in, b1 *out, size_t len) {
+#ifdef LUKE_X86
+  if (ctx->use_aesni) {
+    ctr_ni(ctx, iv, ctr, in, out, len);
+    return;
+  }
+#endif
+  ctr_ct(ctx, iv, ctr, in, out, len);
+}
+
+/* GHASH of the associated data and the data, xored with E(J0) */
+static void make_tag(const AES_GCM_CTX *ctx, const b1 iv[12], const b1 *aad,
+                     size_t aadLen, const b1 *data, size_t len, b1 tag[16]) {
+  static const b1 zeros[16] = {0};
+  b1 ej0[16];
+
+#ifdef LUKE_X86
+  if (ctx->use_aesni)
+    ghash_ni(ctx, aad, aadLen, data, len, tag);
+  else
+#endif
+    ghash_ct(ctx, aad, aadLen, data, len, tag);
+  ctr_xor(ctx, iv, 1, zeros, ej0, 16);
+  for (int i = 0; i < 16; i++)
+    tag[i] ^= ej0[i];
+}
+
+void AES_GCM_Init(AES_GCM_CTX *ctx, const b1 *key, int keyLen,
+                  bool allowAesni) {
+  b1 h[64] = {0};
+
+  key_expansion(ctx, key, keyLen);
+  aes_encrypt4_ct(ctx, h);
+  for (int i = 0; i < 16; i++)
+    ctx->H[i] = h[i];
+  ctx->use_aesni = 0;
+#ifdef LUKE_X86
+  if (allowAesni && cpu_features::get().aesni) {
+    ctx->use_aesni = 1;
+    hpow_ni(ctx);
+  }
+#endif
+}
+
+void AES_GCM_Seal(const AES_GCM_CTX *ctx, const b1 iv[12], const b1 *aad,
+                  size_t aadLen, const b1 *in, b1 *out, size_t len,
+                  b1 tag[16]) {
+  ctr_xor(ctx, iv, 2, in, out, len);
+  make_tag(ctx, iv, aad, aadLen, out, len, tag);
+}
+
+bool AES_GCM_Open(const AES_GCM_CTX *ctx, const b1 iv[12], const b1 *aad,
+                  size_t aadLen, const b1 *in, b1 *out, size_t len,
+                  const b1 tag[16]) {
+  b1 expect[16];
+  b1 diff = 0;
+
+  make_tag(ctx, iv, aad, aadLen, in, len, expect);
+  for (int i = 0; i < 16; i++)
+    diff |= expect[i] ^ tag[i];
+  if (diff != 0)
+    return false;
+  ctr_xor(ctx, iv, 2, in, out, len);
+  return true;
+}
+
+} // namespace luke
@@ -4,12 +4,16 @@
  * Date       :  1997
  * Description:  C implementation of the Blowfish algorithm.
  */
-#include "crypto.hpp"
+#include "blowfish.hpp"
+#include "cpu.hpp"
 #define N               16
 
+#ifdef LUKE_X86
+#define BLOWFISH_AVX2   1
+#endif
+
 namespace luke {
 
-static uInt32 F(BLOWFISH_CTX *ctx, uInt32 x);
 static const uInt32 ORIG_P[16 + 2] = {
         0x243F6A88L, 0x85A308D3L, 0x13198A2EL, 0x03707344L,
         0xA4093822L, 0x299F31D0L, 0x082EFA98L, 0xEC4E6C89L,
@@ -279,78 +283,192 @@ static const uInt32 ORIG_S[4][256] = {
         0x90D4F869L, 0xA65CDEA0L, 0x3F09252DL, 0xC208E69FL,
         0xB74E6132L, 0xCE77E25BL, 0x578FDFE3L, 0x3AC372E6L  }
 };
-uInt32 F(BLOWFISH_CTX *ctx, uInt32 x) {
-   unsigned short a, b, c, d;
-   uInt32  y;
-
-   d = x & 0x00FF;
-   x >>= 8;
-   c = x & 0x00FF;
-   x >>= 8;
-   b = x & 0x00FF;
-   x >>= 8;
-   a = x & 0x00FF;
-
-   y = ctx->S[0][a] + ctx->S[1][b];
-   y = y ^ ctx->S[2][c];
-   y = y + ctx->S[3][d];
-   return y;
+void Blowfish_Encrypt(const BLOWFISH_CTX *ctx, uInt32 *xl, uInt32 *xr) {
+  blowfish::crypt<blowfish::ENCRYPT>(*ctx, *xl, *xr);
+}
+
+void Blowfish_Decrypt(const BLOWFISH_CTX *ctx, uInt32 *xl, uInt32 *xr) {
+  blowfish::crypt<blowfish::DECRYPT>(*ctx, *xl, *xr);
 }
 
-void Blowfish_Encrypt(BLOWFISH_CTX *ctx, uInt32 *xl, uInt32
-*xr) {
-  uInt32  Xl;
-  uInt32  Xr;
-  uInt32  temp;
-  short       i;
-
-  Xl = *xl;
-  Xr = *xr;
-
-  for (i = 0; i < N; ++i) {
-    Xl = Xl ^ ctx->P[i];
-    Xr = F(ctx, Xl) ^ Xr;
-    temp = Xl;
-    Xl = Xr;
-    Xr = temp;
+/*
+ * Bulk ECB over nblocks 8 bytes blocks, each block is the little endian L
+ * and R words as written by push_b4. Four independent blocks go through
+ * the rounds together so the S-box loads of one block overlap with the
+ * others instead of waiting on each other.
+ */
+static inline uInt32 load_le32(const unsigned char *p) {
+  return (uInt32)p[0] | ((uInt32)p[1] << 8) | ((uInt32)p[2] << 16) |
+         ((uInt32)p[3] << 24);
+}
+
+static inline void store_le32(unsigned char *p, uInt32 v) {
+  p[0] = (unsigned char)(v);
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+/*
+ * P is a local copy of ctx->P, the data stores can't alias it. Returns the
+ * number of blocks done, a multiple of 4.
+ */
+template <blowfish::direction D>
+static size_t Blowfish_Blocks_x4(const BLOWFISH_CTX *ctx, const uInt32 *P,
+                                 unsigned char *data, size_t nblocks) {
+  size_t  b;
+
+  for (b = 0; b + 4 <= nblocks; b += 4) {
+    unsigned char *p = data + b * 8;
+    uInt32 l[4] = {load_le32(p), load_le32(p + 8), load_le32(p + 16),
+                   load_le32(p + 24)};
+    uInt32 r[4] = {load_le32(p + 4), load_le32(p + 12), load_le32(p + 20),
+                   load_le32(p + 28)};
+
+    blowfish::crypt<D, 4>(*ctx, P, l, r);
+    store_le32(p, l[0]); store_le32(p + 4, r[0]);
+    store_le32(p + 8, l[1]); store_le32(p + 12, r[1]);
+    store_le32(p + 16, l[2]); store_le32(p + 20, r[2]);
+    store_le32(p + 24, l[3]); store_le32(p + 28, r[3]);
   }
+  return b;
+}
+
+#ifdef BLOWFISH_AVX2
+/*
+ * AVX2 path, picked once from cpuid: 8 blocks per step, the four S-box
+ * lookups of each round are vpgatherdd over all 8 blocks.
+ */
+AVX2_TARGET static inline __m256i F8(const BLOWFISH_CTX *ctx, __m256i x) {
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i a = _mm256_srli_epi32(x, 24);
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(x, 16), mask);
+  __m256i c = _mm256_and_si256(_mm256_srli_epi32(x, 8), mask);
+  __m256i d = _mm256_and_si256(x, mask);
+  __m256i y;
 
-  temp = Xl;
-  Xl = Xr;
-  Xr = temp;
-  Xr = Xr ^ ctx->P[N];
-  Xl = Xl ^ ctx->P[N + 1];
-  *xl = Xl;
-  *xr = Xr;
+  y = _mm256_add_epi32(
+      _mm256_i32gather_epi32((const int *)ctx->S[0], a, 4),
+      _mm256_i32gather_epi32((const int *)ctx->S[1], b, 4));
+  y = _mm256_xor_si256(y, _mm256_i32gather_epi32((const int *)ctx->S[2], c, 4));
+  y = _mm256_add_epi32(y, _mm256_i32gather_epi32((const int *)ctx->S[3], d, 4));
+  return y;
 }
 
-void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uInt32 *xl, uInt32
-*xr) {
-  uInt32  Xl;
-  uInt32  Xr;
-  uInt32  temp;
-  short       i;
-
-  Xl = *xl;
-  Xr = *xr;
-
-  for (i = N + 1; i > 1; --i) {
-    Xl = Xl ^ ctx->P[i];
-    Xr = F(ctx, Xl) ^ Xr;
-    /* Exchange Xl and Xr */
-    temp = Xl;
-    Xl = Xr;
-    Xr = temp;
+/* L0 R0 L1 R1 L2 R2 L3 R3 <-> L0 L1 L2 L3 R0 R1 R2 R3 */
+#define AVX2_SPLIT _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)
+#define AVX2_MERGE _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)
+
+AVX2_TARGET static inline void load8(const unsigned char *data, __m256i *Xl,
+                                     __m256i *Xr) {
+  const __m256i *p = (const __m256i *)data;
+  __m256i v0 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(p), AVX2_SPLIT);
+  __m256i v1 =
+      _mm256_permutevar8x32_epi32(_mm256_loadu_si256(p + 1), AVX2_SPLIT);
+  *Xl = _mm256_permute2x128_si256(v0, v1, 0x20);
+  *Xr = _mm256_permute2x128_si256(v0, v1, 0x31);
+}
+
+/* stores with the final exchange of Xl and Xr done by the caller */
+AVX2_TARGET static inline void store8(unsigned char *data, __m256i Xl,
+                                      __m256i Xr) {
+  __m256i *p = (__m256i *)data;
+  __m256i v0 = _mm256_permute2x128_si256(Xl, Xr, 0x20);
+  __m256i v1 = _mm256_permute2x128_si256(Xl, Xr, 0x31);
+  _mm256_storeu_si256(p, _mm256_permutevar8x32_epi32(v0, AVX2_MERGE));
+  _mm256_storeu_si256(p + 1, _mm256_permutevar8x32_epi32(v1, AVX2_MERGE));
+}
+
+/*
+ * Same contract as Blowfish_Blocks_x4, returns a multiple of 8. Two groups
+ * of 8 blocks are in flight when there are enough, to hide gather latency.
+ */
+template <blowfish::direction D>
+AVX2_TARGET static size_t Blowfish_Blocks_AVX2(const BLOWFISH_CTX *ctx,
+                                               const uInt32 *P,
+                                               unsigned char *data,
+                                               size_t nblocks) {
+  size_t b;
+  short i;
+
+  for (b = 0; b + 16 <= nblocks; b += 16) {
+    __m256i Xl, Xr, Yl, Yr, q;
+    load8(data + b * 8, &Xl, &Xr);
+    load8(data + b * 8 + 64, &Yl, &Yr);
+
+    for (i = 0; i < N; i += 2) {
+      q = _mm256_set1_epi32((int)P[blowfish::p_index(D, i)]);
+      Xl = _mm256_xor_si256(Xl, q);
+      Yl = _mm256_xor_si256(Yl, q);
+      Xr = _mm256_xor_si256(Xr, F8(ctx, Xl));
+      Yr = _mm256_xor_si256(Yr, F8(ctx, Yl));
+      q = _mm256_set1_epi32((int)P[blowfish::p_index(D, i + 1)]);
+      Xr = _mm256_xor_si256(Xr, q);
+      Yr = _mm256_xor_si256(Yr, q);
+      Xl = _mm256_xor_si256(Xl, F8(ctx, Xr));
+      Yl = _mm256_xor_si256(Yl, F8(ctx, Yr));
+    }
+
+    q = _mm256_set1_epi32((int)P[blowfish::p_index(D, N + 1)]);
+    store8(data + b * 8, _mm256_xor_si256(Xr, q),
+           _mm256_xor_si256(Xl, _mm256_set1_epi32((int)P[blowfish::p_index(D, N)])));
+    store8(data + b * 8 + 64, _mm256_xor_si256(Yr, q),
+           _mm256_xor_si256(Yl, _mm256_set1_epi32((int)P[blowfish::p_index(D, N)])));
+  }
+
+  for (; b + 8 <= nblocks; b += 8) {
+    __m256i Xl, Xr;
+    load8(data + b * 8, &Xl, &Xr);
+
+    for (i = 0; i < N; i += 2) {
+      Xl = _mm256_xor_si256(Xl, _mm256_set1_epi32((int)P[blowfish::p_index(D, i)]));
+      Xr = _mm256_xor_si256(Xr, F8(ctx, Xl));
+      Xr = _mm256_xor_si256(Xr, _mm256_set1_epi32((int)P[blowfish::p_index(D, i + 1)]));
+      Xl = _mm256_xor_si256(Xl, F8(ctx, Xr));
+    }
+
+    store8(data + b * 8, _mm256_xor_si256(Xr, _mm256_set1_epi32((int)P[blowfish::p_index(D, N + 1)])),
+           _mm256_xor_si256(Xl, _mm256_set1_epi32((int)P[blowfish::p_index(D, N)])));
+  }
+  return b;
+}
+#endif /* BLOWFISH_AVX2 */
+
+/* the widest kernel the cpu has, then the 4 lanes scalar one, then single
+ * blocks */
+template <blowfish::direction D>
+static void Blowfish_Blocks(const BLOWFISH_CTX *ctx, unsigned char *data,
+                            size_t nblocks) {
+  uInt32 P[N + 2];
+  size_t b = 0;
+  int i;
+
+  for (i = 0; i < N + 2; ++i)
+    P[i] = ctx->P[i];
+#ifdef BLOWFISH_AVX2
+  if (nblocks >= 8 && cpu_features::get().avx2)
+    b = Blowfish_Blocks_AVX2<D>(ctx, P, data, nblocks);
+#endif
+  b += Blowfish_Blocks_x4<D>(ctx, P, data + b * 8, nblocks - b);
+
+  for (; b < nblocks; ++b) {
+    unsigned char *p = data + b * 8;
+    uInt32 L = load_le32(p);
+    uInt32 R = load_le32(p + 4);
+    blowfish::crypt<D, 1>(*ctx, P, &L, &R);
+    store_le32(p, L);
+    store_le32(p + 4, R);
   }
+}
+
+void Blowfish_Encrypt_Blocks(const BLOWFISH_CTX *ctx, unsigned char *data,
+                             size_t nblocks) {
+  Blowfish_Blocks<blowfish::ENCRYPT>(ctx, data, nblocks);
+}
 
-  /* Exchange Xl and Xr */
-  temp = Xl;
-  Xl = Xr;
-  Xr = temp;
-  Xr = Xr ^ ctx->P[1];
-  Xl = Xl ^ ctx->P[0];
-  *xl = Xl;
-  *xr = Xr;
+void Blowfish_Decrypt_Blocks(const BLOWFISH_CTX *ctx, unsigned char *data,
+                             size_t nblocks) {
+  Blowfish_Blocks<blowfish::DECRYPT>(ctx, data, nblocks);
 }
 
 void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "common.hpp"
+#include <utility>
+
+namespace luke {
+typedef b4 uInt32;
+
+#define MAXKEYBYTES 56 /* 448 bits */
+
+typedef struct {
+  uInt32 P[16 + 2];
+  uInt32 S[4][256];
+} BLOWFISH_CTX;
+
+void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen);
+void Blowfish_Encrypt(const BLOWFISH_CTX *ctx, b4 *xl, b4 *xr);
+void Blowfish_Decrypt(const BLOWFISH_CTX *ctx, b4 *xl, b4 *xr);
+// ECB in place over nblocks 8 bytes blocks of little endian L, R words
+void Blowfish_Encrypt_Blocks(const BLOWFISH_CTX *ctx, b1 *data, size_t nblocks);
+void Blowfish_Decrypt_Blocks(const BLOWFISH_CTX *ctx, b1 *data, size_t nblocks);
+} // namespace luke
+
+/*
+Blowfish rounds unrolled at compile time, so callers can inline them into
+their own loops. The halves trade places by trading the arguments of the
+next round, not through a temporary, and decryption is the same code with
+the P-array indexed backwards.
+*/
+// the rounds must all inline into the caller's loop, not stop at a depth
+#if defined(__GNUC__)
+#define BLOWFISH_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define BLOWFISH_INLINE __forceinline
+#else
+#define BLOWFISH_INLINE inline
+#endif
+
+namespace luke {
+namespace blowfish {
+
+enum { ROUNDS = 16 };
+enum direction { ENCRYPT, DECRYPT };
+
+// P word used by round i
+constexpr int p_index(direction d, int i) {
+  return d == ENCRYPT ? i : ROUNDS + 1 - i;
+}
+
+BLOWFISH_INLINE uInt32 F(const BLOWFISH_CTX &ctx, uInt32 x) {
+  return ((ctx.S[0][x >> 24] + ctx.S[1][(x >> 16) & 0xFF]) ^
+          ctx.S[2][(x >> 8) & 0xFF]) +
+         ctx.S[3][x & 0xFF];
+}
+
+/*
+Round I and the ones after it over the blocks k.... The lanes are expanded
+from a pack, not looped over, so every index is a constant and the compiler
+keeps each lane in its own register.
+*/
+template <direction D, int I> struct rounds {
+  template <size_t... k>
+  static BLOWFISH_INLINE void run(const BLOWFISH_CTX &ctx, const uInt32 *P,
+                                  uInt32 *l, uInt32 *r,
+                                  std::index_sequence<k...> lanes) {
+    using expand = int[];
+    (void)expand{0, (l[k] ^= P[p_index(D, I)], 0)...};
+    (void)expand{0, (r[k] ^= F(ctx, l[k]), 0)...};
+    rounds<D, I + 1>::run(ctx, P, r, l, lanes);
+  }
+};
+
+template <direction D> struct rounds<D, ROUNDS> {
+  template <size_t... k>
+  static BLOWFISH_INLINE void run(const BLOWFISH_CTX & /*ctx*/, const uInt32 *P,
+                         uInt32 *l, uInt32 *r, std::index_sequence<k...>) {
+    // undo the last exchange and whiten
+    using expand = int[];
+    (void)expand{0, (std::swap(l[k], r[k]), 0)...};
+    (void)expand{0, (r[k] ^= P[p_index(D, ROUNDS)], 0)...};
+    (void)expand{0, (l[k] ^= P[p_index(D, ROUNDS + 1)], 0)...};
+  }
+};
+
+/*
+K blocks as L and R words. P is ctx.P or a local copy of it, a copy lets
+the compiler keep the words in registers across stores to the data.
+*/
+template <direction D, size_t... k>
+BLOWFISH_INLINE void crypt(const BLOWFISH_CTX &ctx, const uInt32 *P,
+                           uInt32 *xl, uInt32 *xr,
+                           std::index_sequence<k...> lanes) {
+  // locals, stores through xl and xr could alias the S-boxes
+  uInt32 l[sizeof...(k)] = {xl[k]...};
+  uInt32 r[sizeof...(k)] = {xr[k]...};
+  using expand = int[];
+
+  rounds<D, 0>::run(ctx, P, l, r, lanes);
+  (void)expand{0, (xl[k] = l[k], xr[k] = r[k], 0)...};
+}
+
+template <direction D, size_t K>
+BLOWFISH_INLINE void crypt(const BLOWFISH_CTX &ctx, const uInt32 *P,
+                           uInt32 *xl, uInt32 *xr) {
+  crypt<D>(ctx, P, xl, xr, std::make_index_sequence<K>());
+}
+
+template <direction D>
+BLOWFISH_INLINE void crypt(const BLOWFISH_CTX &ctx, uInt32 &xl, uInt32 &xr) {
+  crypt<D, 1>(ctx, ctx.P, &xl, &xr);
+}
+
+} // namespace blowfish
+} // namespace luke
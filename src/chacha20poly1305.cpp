@@ -0,0 +1,421 @@
+/*
+ * ChaCha20 and Poly1305 as in RFC 8439.
+ * ChaCha20 blocks are independent, bulk data goes through AVX2 (8 blocks)
+ * or SSE2 (4 blocks) kernels picked from cpuid, each vector holding one
+ * state word of every block. Poly1305 is poly1305-donna with 26 bit limbs.
+ */
+#include "cipher.hpp"
+#include "cpu.hpp"
+
+namespace luke {
+
+static inline b4 load_le32(const b1 *p) {
+  return (b4)p[0] | ((b4)p[1] << 8) | ((b4)p[2] << 16) | ((b4)p[3] << 24);
+}
+
+static inline void store_le32(b1 *p, b4 v) {
+  p[0] = (b1)(v);
+  p[1] = (b1)(v >> 8);
+  p[2] = (b1)(v >> 16);
+  p[3] = (b1)(v >> 24);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d)                                                       \
+  a += b; d ^= a; d = ROTL32(d, 16);                                         \
+  c += d; b ^= c; b = ROTL32(b, 12);                                         \
+  a += b; d ^= a; d = ROTL32(d, 8);                                          \
+  c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha_init(b4 st[16], const b1 key[32], const b1 nonce[12],
+                        b4 counter) {
+  int i;
+
+  /* "expand 32-byte k" */
+  st[0] = 0x61707865;
+  st[1] = 0x3320646e;
+  st[2] = 0x79622d32;
+  st[3] = 0x6b206574;
+  for (i = 0; i < 8; i++)
+    st[4 + i] = load_le32(key + i * 4);
+  st[12] = counter;
+  for (i = 0; i < 3; i++)
+    st[13 + i] = load_le32(nonce + i * 4);
+}
+
+static void chacha_block(const b4 st[16], b1 out[64]) {
+  b4 x[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    x[i] = st[i];
+  for (i = 0; i < 10; i++) {
+    QR(x[0], x[4], x[8], x[12]);
+    QR(x[1], x[5], x[9], x[13]);
+    QR(x[2], x[6], x[10], x[14]);
+    QR(x[3], x[7], x[11], x[15]);
+    QR(x[0], x[5], x[10], x[15]);
+    QR(x[1], x[6], x[11], x[12]);
+    QR(x[2], x[7], x[8], x[13]);
+    QR(x[3], x[4], x[9], x[14]);
+  }
+  for (i = 0; i < 16; i++)
+    store_le32(out + i * 4, x[i] + st[i]);
+}
+
+#ifdef LUKE_X86
+#define QR4(a, b, c, d, ROT16, ROT8)                                         \
+  a = ADD(a, b); d = XOR(d, a); d = ROT16(d);                                \
+  c = ADD(c, d); b = XOR(b, c); b = ROTL(b, 12);                             \
+  a = ADD(a, b); d = XOR(d, a); d = ROT8(d);                                 \
+  c = ADD(c, d); b = XOR(b, c); b = ROTL(b, 7);
+
+#define DOUBLE_ROUND(x, ROT16, ROT8)                                         \
+  QR4(x[0], x[4], x[8], x[12], ROT16, ROT8)                                  \
+  QR4(x[1], x[5], x[9], x[13], ROT16, ROT8)                                  \
+  QR4(x[2], x[6], x[10], x[14], ROT16, ROT8)                                 \
+  QR4(x[3], x[7], x[11], x[15], ROT16, ROT8)                                 \
+  QR4(x[0], x[5], x[10], x[15], ROT16, ROT8)                                 \
+  QR4(x[1], x[6], x[11], x[12], ROT16, ROT8)                                 \
+  QR4(x[2], x[7], x[8], x[13], ROT16, ROT8)                                  \
+  QR4(x[3], x[4], x[9], x[14], ROT16, ROT8)
+
+/* 4 blocks, lane j of x[i] is word i of block j */
+#define ADD(a, b) _mm_add_epi32(a, b)
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define ROTL(v, n)                                                             \
+  _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define ROTL16(v) ROTL(v, 16)
+#define ROTL8(v) ROTL(v, 8)
+
+SSE2_TARGET static size_t chacha_blocks_sse2(b4 st[16], const b1 *in, b1 *out,
+                                             size_t nblocks) {
+  size_t b;
+  int i, g;
+
+  for (b = 0; b + 4 <= nblocks; b += 4) {
+    __m128i x[16], o[16];
+
+    for (i = 0; i < 16; i++)
+      o[i] = _mm_set1_epi32((int)st[i]);
+    o[12] = _mm_add_epi32(o[12], _mm_setr_epi32(0, 1, 2, 3));
+    for (i = 0; i < 16; i++)
+      x[i] = o[i];
+    for (i = 0; i < 10; i++) {
+      DOUBLE_ROUND(x, ROTL16, ROTL8)
+    }
+    for (i = 0; i < 16; i++)
+      x[i] = _mm_add_epi32(x[i], o[i]);
+
+    /* transpose each group of 4 words back into the 4 blocks */
+    for (g = 0; g < 4; g++) {
+      __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+      __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+      __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+      __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+      __m128i blk[4];
+      blk[0] = _mm_unpacklo_epi64(t0, t1);
+      blk[1] = _mm_unpackhi_epi64(t0, t1);
+      blk[2] = _mm_unpacklo_epi64(t2, t3);
+      blk[3] = _mm_unpackhi_epi64(t2, t3);
+      for (i = 0; i < 4; i++) {
+        const __m128i *src = (const __m128i *)(in + i * 64 + g * 16);
+        __m128i *dst = (__m128i *)(out + i * 64 + g * 16);
+        _mm_storeu_si128(dst, _mm_xor_si128(_mm_loadu_si128(src), blk[i]));
+      }
+    }
+
+    st[12] += 4;
+    in += 256;
+    out += 256;
+  }
+  return b;
+}
+
+#undef ADD
+#undef XOR
+#undef ROTL
+#undef ROTL16
+#undef ROTL8
+
+/* 8 blocks, lane j of x[i] is word i of block j */
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROTL(v, n)                                                           \
+  _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define ROTB16(v) _mm256_shuffle_epi8(v, rot16)
+#define ROTB8(v) _mm256_shuffle_epi8(v, rot8)
+
+AVX2_TARGET static size_t chacha_blocks_avx2(b4 st[16], const b1 *in, b1 *out,
+                                             size_t nblocks) {
+  const __m256i rot16 =
+      _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                       2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rot8 =
+      _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                       3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+  size_t b;
+  int i, g;
+
+  for (b = 0; b + 8 <= nblocks; b += 8) {
+    __m256i x[16], o[16], r[4][4];
+
+    for (i = 0; i < 16; i++)
+      o[i] = _mm256_set1_epi32((int)st[i]);
+    o[12] = _mm256_add_epi32(o[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for (i = 0; i < 16; i++)
+      x[i] = o[i];
+    for (i = 0; i < 10; i++) {
+      DOUBLE_ROUND(x, ROTB16, ROTB8)
+    }
+    for (i = 0; i < 16; i++)
+      x[i] = _mm256_add_epi32(x[i], o[i]);
+
+    /*
+     * r[g][j] is words 4g..4g+3 of block j in the low half and of block
+     * j + 4 in the high half
+     */
+    for (g = 0; g < 4; g++) {
+      __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+      __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+      __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+      __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+      r[g][0] = _mm256_unpacklo_epi64(t0, t1);
+      r[g][1] = _mm256_unpackhi_epi64(t0, t1);
+      r[g][2] = _mm256_unpacklo_epi64(t2, t3);
+      r[g][3] = _mm256_unpackhi_epi64(t2, t3);
+    }
+    for (i = 0; i < 4; i++) {
+      /* 32 bytes at a time: words 0..7 then 8..15 of block i and i + 4 */
+      __m256i k[4];
+      k[0] = _mm256_permute2x128_si256(r[0][i], r[1][i], 0x20);
+      k[1] = _mm256_permute2x128_si256(r[2][i], r[3][i], 0x20);
+      k[2] = _mm256_permute2x128_si256(r[0][i], r[1][i], 0x31);
+      k[3] = _mm256_permute2x128_si256(r[2][i], r[3][i], 0x31);
+      for (g = 0; g < 4; g++) {
+        size_t pos = (g < 2 ? i : i + 4) * 64 + (g % 2) * 32;
+        const __m256i *src = (const __m256i *)(in + pos);
+        __m256i *dst = (__m256i *)(out + pos);
+        _mm256_storeu_si256(dst,
+                            _mm256_xor_si256(_mm256_loadu_si256(src), k[g]));
+      }
+    }
+
+    st[12] += 8;
+    in += 512;
+    out += 512;
+  }
+  return b;
+}
+
+#undef ADD
+#undef XOR
+#undef ROTL
+#undef ROTB16
+#undef ROTB8
+#endif /* LUKE_X86 */
+
+void ChaCha20_Xor(const b1 key[32], const b1 nonce[12], b4 counter,
+                  const b1 *in, b1 *out, size_t len) {
+  b4 st[16];
+  b1 ks[64];
+  size_t nblocks = len / 64, b = 0, i;
+
+  chacha_init(st, key, nonce, counter);
+#ifdef LUKE_X86
+  if (nblocks >= 8 && cpu_features::get().avx2) {
+    b = chacha_blocks_avx2(st, in, out, nblocks);
+  }
+  if (nblocks - b >= 4 && cpu_features::get().sse2) {
+    b += chacha_blocks_sse2(st, in + b * 64, out + b * 64, nblocks - b);
+  }
+#endif
+  in += b * 64;
+  out += b * 64;
+  len -= b * 64;
+
+  while (len > 0) {
+    size_t n = len < 64 ? len : 64;
+    chacha_block(st, ks);
+    for (i = 0; i < n; i++)
+      out[i] = in[i] ^ ks[i];
+    st[12]++;
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+
+void Poly1305_Init(POLY1305_CTX *ctx, const b1 key[32]) {
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  ctx->r[0] = (load_le32(key + 0)) & 0x3ffffff;
+  ctx->r[1] = (load_le32(key + 3) >> 2) & 0x3ffff03;
+  ctx->r[2] = (load_le32(key + 6) >> 4) & 0x3ffc0ff;
+  ctx->r[3] = (load_le32(key + 9) >> 6) & 0x3f03fff;
+  ctx->r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+
+  ctx->h[0] = ctx->h[1] = ctx->h[2] = ctx->h[3] = ctx->h[4] = 0;
+
+  ctx->pad[0] = load_le32(key + 16);
+  ctx->pad[1] = load_le32(key + 20);
+  ctx->pad[2] = load_le32(key + 24);
+  ctx->pad[3] = load_le32(key + 28);
+
+  ctx->leftover = 0;
+  ctx->final = 0;
+}
+
+static void poly1305_blocks(POLY1305_CTX *ctx, const b1 *m, size_t bytes) {
+  const b4 hibit = ctx->final ? 0 : (1UL << 24); /* 1 << 128 */
+  b4 r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3],
+     r4 = ctx->r[4];
+  b4 s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  b4 h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3],
+     h4 = ctx->h[4];
+  b8 d0, d1, d2, d3, d4;
+  b4 c;
+
+  while (bytes >= 16) {
+    /* h += m[i] */
+    h0 += (load_le32(m + 0)) & 0x3ffffff;
+    h1 += (load_le32(m + 3) >> 2) & 0x3ffffff;
+    h2 += (load_le32(m + 6) >> 4) & 0x3ffffff;
+    h3 += (load_le32(m + 9) >> 6) & 0x3ffffff;
+    h4 += (load_le32(m + 12) >> 8) | hibit;
+
+    /* h *= r */
+    d0 = ((b8)h0 * r0) + ((b8)h1 * s4) + ((b8)h2 * s3) + ((b8)h3 * s2) +
+         ((b8)h4 * s1);
+    d1 = ((b8)h0 * r1) + ((b8)h1 * r0) + ((b8)h2 * s4) + ((b8)h3 * s3) +
+         ((b8)h4 * s2);
+    d2 = ((b8)h0 * r2) + ((b8)h1 * r1) + ((b8)h2 * r0) + ((b8)h3 * s4) +
+         ((b8)h4 * s3);
+    d3 = ((b8)h0 * r3) + ((b8)h1 * r2) + ((b8)h2 * r1) + ((b8)h3 * r0) +
+         ((b8)h4 * s4);
+    d4 = ((b8)h0 * r4) + ((b8)h1 * r3) + ((b8)h2 * r2) + ((b8)h3 * r1) +
+         ((b8)h4 * r0);
+
+    /* (partial) h %= p */
+    c = (b4)(d0 >> 26); h0 = (b4)d0 & 0x3ffffff;
+    d1 += c; c = (b4)(d1 >> 26); h1 = (b4)d1 & 0x3ffffff;
+    d2 += c; c = (b4)(d2 >> 26); h2 = (b4)d2 & 0x3ffffff;
+    d3 += c; c = (b4)(d3 >> 26); h3 = (b4)d3 & 0x3ffffff;
+    d4 += c; c = (b4)(d4 >> 26); h4 = (b4)d4 & 0x3ffffff;
+    h0 += c * 5; c = (h0 >> 26); h0 = h0 & 0x3ffffff;
+    h1 += c;
+
+    m += 16;
+    bytes -= 16;
+  }
+
+  ctx->h[0] = h0;
+  ctx->h[1] = h1;
+  ctx->h[2] = h2;
+  ctx->h[3] = h3;
+  ctx->h[4] = h4;
+}
+
+void Poly1305_Update(POLY1305_CTX *ctx, const b1 *m, size_t bytes) {
+  size_t i;
+
+  /* handle leftover */
+  if (ctx->leftover) {
+    size_t want = 16 - ctx->leftover;
+    if (want > bytes)
+      want = bytes;
+    for (i = 0; i < want; i++)
+      ctx->buffer[ctx->leftover + i] = m[i];
+    bytes -= want;
+    m += want;
+    ctx->leftover += want;
+    if (ctx->leftover < 16)
+      return;
+    poly1305_blocks(ctx, ctx->buffer, 16);
+    ctx->leftover = 0;
+  }
+
+  /* process full blocks */
+  if (bytes >= 16) {
+    size_t want = bytes & ~(size_t)15;
+    poly1305_blocks(ctx, m, want);
+    m += want;
+    bytes -= want;
+  }
+
+  /* store leftover */
+  for (i = 0; i < bytes; i++)
+    ctx->buffer[ctx->leftover + i] = m[i];
+  ctx->leftover += bytes;
+}
+
+void Poly1305_Final(POLY1305_CTX *ctx, b1 mac[16]) {
+  b4 h0, h1, h2, h3, h4, c;
+  b4 g0, g1, g2, g3, g4;
+  b8 f;
+  b4 mask;
+
+  /* process the remaining block */
+  if (ctx->leftover) {
+    size_t i = ctx->leftover;
+    ctx->buffer[i++] = 1;
+    for (; i < 16; i++)
+      ctx->buffer[i] = 0;
+    ctx->final = 1;
+    poly1305_blocks(ctx, ctx->buffer, 16);
+  }
+
+  /* fully carry h */
+  h0 = ctx->h[0];
+  h1 = ctx->h[1];
+  h2 = ctx->h[2];
+  h3 = ctx->h[3];
+  h4 = ctx->h[4];
+
+  c = h1 >> 26; h1 = h1 & 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 = h2 & 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 = h3 & 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 = h4 & 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 = h0 & 0x3ffffff;
+  h1 += c;
+
+  /* compute h + -p */
+  g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  g4 = h4 + c - (1UL << 26);
+
+  /* select h if h < p, or h + -p if h >= p */
+  mask = (g4 >> 31) - 1;
+  g0 &= mask;
+  g1 &= mask;
+  g2 &= mask;
+  g3 &= mask;
+  g4 &= mask;
+  mask = ~mask;
+  h0 = (h0 & mask) | g0;
+  h1 = (h1 & mask) | g1;
+  h2 = (h2 & mask) | g2;
+  h3 = (h3 & mask) | g3;
+  h4 = (h4 & mask) | g4;
+
+  /* h = h % (2^128) */
+  h0 = ((h0) | (h1 << 26)) & 0xffffffff;
+  h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+  h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+  h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+  /* mac = (h + pad) % (2^128) */
+  f = (b8)h0 + ctx->pad[0]; h0 = (b4)f;
+  f = (b8)h1 + ctx->pad[1] + (f >> 32); h1 = (b4)f;
+  f = (b8)h2 + ctx->pad[2] + (f >> 32); h2 = (b4)f;
+  f = (b8)h3 + ctx->pad[3] + (f >> 32); h3 = (b4)f;
+
+  store_le32(mac + 0, h0);
+  store_le32(mac + 4, h1);
+  store_le32(mac + 8, h2);
+  store_le32(mac + 12, h3);
+}
+
+} // namespace luke
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "blowfish.hpp"
+#include "common.hpp"
+
+namespace luke {
+typedef struct {
+  b4 r[5];
+  b4 h[5];
+  b4 pad[4];
+  size_t leftover;
+  b1 buffer[16];
+  b1 final;
+} POLY1305_CTX;
+
+// RFC 8439 ChaCha20, in and out may be the same buffer
+void ChaCha20_Xor(const b1 key[32], const b1 nonce[12], b4 counter,
+                  const b1 *in, b1 *out, size_t len);
+void Poly1305_Init(POLY1305_CTX *ctx, const b1 key[32]);
+void Poly1305_Update(POLY1305_CTX *ctx, const b1 *m, size_t bytes);
+void Poly1305_Final(POLY1305_CTX *ctx, b1 mac[16]);
+
+typedef struct {
+  b1 rk[15][16];
+  // the round keys as bit planes for the constant time path
+  b8 rkp[15][8];
+  int rounds;
+  b1 H[16];
+  // H^1..H^4 byte reversed, for the PCLMULQDQ GHASH
+  b1 Hpow[4][16];
+  b1 use_aesni;
+} AES_GCM_CTX;
+
+// keyLen 16 or 32; allowAesni false forces the constant time software path
+void AES_GCM_Init(AES_GCM_CTX *ctx, const b1 *key, int keyLen,
+                  bool allowAesni = true);
+// aad is authenticated, not encrypted; in and out may be the same buffer
+void AES_GCM_Seal(const AES_GCM_CTX *ctx, const b1 iv[12], const b1 *aad,
+                  size_t aadLen, const b1 *in, b1 *out, size_t len,
+                  b1 tag[16]);
+// checks the tag first, out is untouched if it doesn't match
+bool AES_GCM_Open(const AES_GCM_CTX *ctx, const b1 iv[12], const b1 *aad,
+                  size_t aadLen, const b1 *in, b1 *out, size_t len,
+                  const b1 tag[16]);
+
+/*
+A frame body cipher. crypto compresses the body and seals the zlib data
+with the cipher named by the header flags. Every frame takes a fresh range
+of nonces from the sending side's counter, and the first one travels in
+the header. The AEAD ciphers also authenticate aad, the header fields the
+body belongs to; the others ignore it.
+*/
+class cipher {
+public:
+  virtual ~cipher() {}
+
+  // the most bytes seal() adds to its input
+  virtual size_t overhead() const = 0;
+  // how many nonces a frame of len bytes uses up
+  virtual b8 nonces(size_t len) const = 0;
+  // dst must hold len + overhead(), returns the bytes written
+  virtual size_t seal(b8 nonce, const b1 *aad, size_t aad_len, const b1 *src,
+                      size_t len, b1 *dst) = 0;
+  // in place, plain is set inside data; false if malformed or not authentic
+  virtual bool open(b8 nonce, const b1 *aad, size_t aad_len, b1 *data,
+                    size_t len, b1 *&plain, size_t &plain_len) = 0;
+};
+
+/*
+The original mode
+  real data length b4
+  reserved b4
+  data, zero padded to 8 bytes blocks
+*/
+class blowfish_ecb : public cipher {
+public:
+  blowfish_ecb(std::shared_ptr<const BLOWFISH_CTX> ctx) : ctx_(ctx) {}
+
+  size_t overhead() const override { return 8 + 7; }
+
+  b8 nonces(size_t /*len*/) const override { return 0; }
+
+  size_t seal(b8 /*nonce*/, const b1 * /*aad*/, size_t /*aad_len*/,
+              const b1 *src, size_t len, b1 *dst) override {
+    size_t total = 8 + ((len + 7) & ~size_t(7));
+    put_b4(dst, (b4)len);
+    put_b4(dst + 4, 0);
+    std::copy(src, src + len, dst + 8);
+    std::fill(dst + 8 + len, dst + total, 0);
+    Blowfish_Encrypt_Blocks(ctx_.get(), dst, total / 8);
+    return total;
+  }
+
+  bool open(b8 /*nonce*/, const b1 * /*aad*/, size_t /*aad_len*/, b1 *data,
+            size_t len, b1 *&plain, size_t &plain_len) override {
+    if ((len % 8) != 0 || len < 8) {
+      std::cerr << "decrypt need 8 bytes pad" << std::endl;
+      return false;
+    }
+    Blowfish_Decrypt_Blocks(ctx_.get(), data, len / 8);
+    b4 dlen = (b4)data[0] | ((b4)data[1] << 8) | ((b4)data[2] << 16) |
+              ((b4)data[3] << 24);
+    if (dlen > len - 8) {
+      std::cerr << "decrypt data length out of range" << std::endl;
+      return false;
+    }
+    plain = data + 8;
+    plain_len = dlen;
+    return true;
+  }
+
+private:
+  std::shared_ptr<const BLOWFISH_CTX> ctx_;
+};
+
+/*
+Counter mode, no length block and no padding. Keystream block i is
+blowfish(nonce + i) as little endian L, R words.
+*/
+class blowfish_ctr : public cipher {
+public:
+  blowfish_ctr(std::shared_ptr<const BLOWFISH_CTX> ctx) : ctx_(ctx) {}
+
+  size_t overhead() const override { return 0; }
+
+  b8 nonces(size_t len) const override { return (len + 7) / 8; }
+
+  size_t seal(b8 nonce, const b1 * /*aad*/, size_t /*aad_len*/,
+              const b1 *src, size_t len, b1 *dst) override {
+    std::copy(src, src + len, dst);
+    xor_keystream(nonce, 0, dst, len);
+    return len;
+  }
+
+  bool open(b8 nonce, const b1 * /*aad*/, size_t /*aad_len*/, b1 *data,
+            size_t len, b1 *&plain, size_t &plain_len) override {
+    xor_keystream(nonce, 0, data, len);
+    plain = data;
+    plain_len = len;
+    return true;
+  }
+
+  /*
+  xor data with the keystream of nonce from byte offset on. Blocks don't
+  depend on each other, so any offset can be done on its own and a chunk
+  of keystream is made with one bulk ECB call.
+  */
+  void xor_keystream(b8 nonce, size_t offset, b1 *data, size_t len) {
+    enum { KS_BLOCKS = 512 };
+    ks_.resize(KS_BLOCKS * 8);
+    while (len > 0) {
+      b8 counter = nonce + offset / 8;
+      size_t skip = offset % 8;
+      size_t n = std::min(len, KS_BLOCKS * 8 - skip);
+      size_t nblocks = (skip + n + 7) / 8;
+      for (size_t i = 0; i < nblocks; i++) {
+        put_b8(&ks_[i * 8], counter + i);
+      }
+      Blowfish_Encrypt_Blocks(ctx_.get(), ks_.data(), nblocks);
+      for (size_t i = 0; i < n; i++) {
+        data[i] ^= ks_[skip + i];
+      }
+      data += n;
+      len -= n;
+      offset += n;
+    }
+  }
+
+private:
+  std::shared_ptr<const BLOWFISH_CTX> ctx_;
+  bytes ks_;
+};
+
+/*
+RFC 8439 AEAD over the header fields as associated data, the 16 bytes tag
+follows the data.
+The tag is checked before anything is decrypted, so a corrupted frame is
+dropped before zlib sees it. The 256 bit key is the blowfish encryption of
+a fixed label under the configured key, the nonce is 4 zero bytes and the
+little endian frame nonce.
+*/
+class chacha20_poly1305 : public cipher {
+public:
+  enum { TAG_SIZE = 16 };
+
+  chacha20_poly1305(std::shared_ptr<const BLOWFISH_CTX> ctx) {
+    for (b4 i = 0; i < 4; i++) {
+      put_b4(key_ + i * 8, 0x63686163); // "chac"
+      put_b4(key_ + i * 8 + 4, i);
+    }
+    Blowfish_Encrypt_Blocks(ctx.get(), key_, 4);
+  }
+
+  chacha20_poly1305(const b1 key[32]) { std::copy(key, key + 32, key_); }
+
+  size_t overhead() const override { return TAG_SIZE; }
+
+  b8 nonces(size_t /*len*/) const override { return 1; }
+
+  size_t seal(b8 nonce, const b1 *aad, size_t aad_len, const b1 *src,
+              size_t len, b1 *dst) override {
+    b1 n[12];
+    make_nonce(nonce, n);
+    ChaCha20_Xor(key_, n, 1, src, dst, len);
+    mac(n, aad, aad_len, dst, len, dst + len);
+    return len + TAG_SIZE;
+  }
+
+  bool open(b8 nonce, const b1 *aad, size_t aad_len, b1 *data, size_t len,
+            b1 *&plain, size_t &plain_len) override {
+    if (len < TAG_SIZE) {
+      return false;
+    }
+    b1 n[12];
+    b1 tag[TAG_SIZE];
+    make_nonce(nonce, n);
+    len -= TAG_SIZE;
+    mac(n, aad, aad_len, data, len, tag);
+    // constant time compare
+    b1 diff = 0;
+    for (int i = 0; i < TAG_SIZE; i++) {
+      diff |= tag[i] ^ data[len + i];
+    }
+    if (diff != 0) {
+      log_err("chacha20-poly1305 tag mismatch");
+      return false;
+    }
+    ChaCha20_Xor(key_, n, 1, data, data, len);
+    plain = data;
+    plain_len = len;
+    return true;
+  }
+
+  // poly1305 over the associated data and the ciphertext
+  void mac(const b1 n[12], const b1 *aad, size_t aad_len, const b1 *data,
+           size_t len, b1 tag[TAG_SIZE]) {
+    static const b1 zeros[32] = {0};
+    b1 otk[32];
+    ChaCha20_Xor(key_, n, 0, zeros, otk, sizeof(otk));
+    POLY1305_CTX poly;
+    Poly1305_Init(&poly, otk);
+    Poly1305_Update(&poly, aad, aad_len);
+    Poly1305_Update(&poly, zeros, (16 - aad_len % 16) % 16);
+    Poly1305_Update(&poly, data, len);
+    Poly1305_Update(&poly, zeros, (16 - len % 16) % 16);
+    b1 lens[16];
+    put_b8(lens, aad_len);
+    put_b8(lens + 8, len);
+    Poly1305_Update(&poly, lens, sizeof(lens));
+    Poly1305_Final(&poly, tag);
+  }
+
+private:
+  static void make_nonce(b8 nonce, b1 n[12]) {
+    put_b4(n, 0);
+    put_b8(n + 4, nonce);
+  }
+
+  b1 key_[32];
+};
+
+/*
+AES-128-GCM or AES-256-GCM over the header fields as associated data, the
+16 bytes tag follows the data and is checked before decrypting. The key is
+derived like the chacha20 one with its own label, the IV is 4 zero bytes and
+the little endian frame nonce.
+*/
+class aes_gcm : public cipher {
+public:
+  enum { TAG_SIZE = 16 };
+
+  aes_gcm(std::shared_ptr<const BLOWFISH_CTX> ctx, int key_len) {
+    b1 key[32];
+    for (b4 i = 0; i < 4; i++) {
+      // "a128", "a256"
+      put_b4(key + i * 8, key_len == 16 ? 0x38323161 : 0x36353261);
+      put_b4(key + i * 8 + 4, i);
+    }
+    Blowfish_Encrypt_Blocks(ctx.get(), key, 4);
+    AES_GCM_Init(&ctx_, key, key_len);
+  }
+
+  aes_gcm(const b1 *key, int key_len, bool allow_aesni = true) {
+    AES_GCM_Init(&ctx_, key, key_len, allow_aesni);
+  }
+
+  size_t overhead() const override { return TAG_SIZE; }
+
+  b8 nonces(size_t /*len*/) const override { return 1; }
+
+  size_t seal(b8 nonce, const b1 *aad, size_t aad_len, const b1 *src,
+              size_t len, b1 *dst) override {
+    b1 iv[12];
+    make_iv(nonce, iv);
+    AES_GCM_Seal(&ctx_, iv, aad, aad_len, src, dst, len, dst + len);
+    return len + TAG_SIZE;
+  }
+
+  bool open(b8 nonce, const b1 *aad, size_t aad_len, b1 *data, size_t len,
+            b1 *&plain, size_t &plain_len) override {
+    if (len < TAG_SIZE) {
+      return false;
+    }
+    b1 iv[12];
+    make_iv(nonce, iv);
+    len -= TAG_SIZE;
+    if (!AES_GCM_Open(&ctx_, iv, aad, aad_len, data, data, len, data + len)) {
+      log_err("aes-gcm tag mismatch");
+      return false;
+    }
+    plain = data;
+    plain_len = len;
+    return true;
+  }
+
+private:
+  static void make_iv(b8 nonce, b1 iv[12]) {
+    put_b4(iv, 0);
+    put_b8(iv + 4, nonce);
+  }
+
+  AES_GCM_CTX ctx_;
+};
+
+} // namespace luke
@@ -15,6 +15,7 @@
 #include <iostream>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <regex>
@@ -255,6 +256,35 @@ inline void push_b8(bytes &v, const uint64_t u64) {
 #endif
 }
 
+// little endian stores into and loads from a caller buffer with room
+inline void put_b2(b1 *p, const uint16_t u16) {
+  p[0] = u16 & 0x00FF;
+  p[1] = (u16 & 0xFF00) >> 8;
+}
+
+inline void put_b4(b1 *p, const uint32_t u32) {
+  p[0] = u32 & 0x000000FF;
+  p[1] = (u32 & 0x0000FF00) >> 8;
+  p[2] = (u32 & 0x00FF0000) >> 16;
+  p[3] = (u32 & 0xFF000000) >> 24;
+}
+
+inline void put_b8(b1 *p, const uint64_t u64) {
+  put_b4(p, (uint32_t)(u64 & 0xFFFFFFFF));
+  put_b4(p + 4, (uint32_t)(u64 >> 32));
+}
+
+inline uint16_t get_b2(const b1 *p) { return uint16_t(p[0] | (p[1] << 8)); }
+
+inline uint32_t get_b4(const b1 *p) {
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+         (uint32_t(p[3]) << 24);
+}
+
+inline uint64_t get_b8(const b1 *p) {
+  return uint64_t(get_b4(p)) | (uint64_t(get_b4(p + 4)) << 32);
+}
+
 inline uint8_t get_b1(const bytes &v, const int begin) {
   if (begin < 0 || (begin + 1) > v.size()) {
     throw std::range_error("get_b1 out of range");
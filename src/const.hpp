@@ -2,6 +2,51 @@
 
 namespace luke {
 enum { VER=20180517, MAX_BUF_SIZE = 65535 };
+// the most a frame carries to a peer with CAP_LARGE_FRAMES
+enum { LARGE_FRAME_SIZE = 1024 * 1024 };
+// the bytes of a stream either side may send before the other grants more
+// with STREAM_CREDIT, when both have CAP_CREDITS. Stream 0 counts only on a
+// tunnel with CAP_STREAMS, from a STREAM_CREDIT of nothing the client sends
+enum { STREAM_WINDOW = 256 * 1024 };
 enum { OK, ERROR = 1 };
-enum { NOPE = 1025, GET_URL, SOCKS_CONNECT };
+enum {
+  NOPE = 1025,
+  GET_URL,
+  SOCKS_CONNECT,
+  STREAM_OPEN,
+  STREAM_CLOSE,
+  STREAM_CREDIT // body b4: more bytes of the stream the sender takes
+};
+// body cipher of a frame, low byte of the header flags
+enum {
+  CIPHER_ECB = 0,
+  CIPHER_CTR = 1,
+  CIPHER_CHACHA20_POLY1305 = 2,
+  CIPHER_AES128_GCM = 3,
+  CIPHER_AES256_GCM = 4,
+  CIPHER_COUNT
+};
+// what a peer can decode, advertised in the header caps
+enum {
+  CAP_CTR = 1 << 0,
+  CAP_CHACHA20_POLY1305 = 1 << 1,
+  CAP_AES_GCM = 1 << 2, // both key sizes
+  CAP_ZSTREAM = 1 << 3,
+  CAP_RAW = 1 << 4,
+  CAP_LZ4 = 1 << 5,
+  CAP_COMPACT_HEADER = 1 << 6,
+  CAP_ZCHUNKS = 1 << 7,
+  CAP_STREAMS = 1 << 8,
+  CAP_LARGE_FRAMES = 1 << 9, // takes bodies of LARGE_FRAME_SIZE
+  CAP_CREDITS = 1 << 10       // grants STREAM_CREDIT and keeps to it
+};
+// body compression of a frame, second byte of the header flags
+enum {
+  CODEC_ZLIB = 0,    // a zlib stream per frame
+  CODEC_ZSTREAM = 1, // one zlib stream per direction, sync flush per frame
+  CODEC_RAW = 2,     // not compressed
+  CODEC_LZ4 = 3,     // an LZ4 block per frame
+  CODEC_ZCHUNKS = 4, // independent zlib streams of a large frame's chunks
+  CODEC_COUNT
+};
 } // namespace luke
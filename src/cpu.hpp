@@ -0,0 +1,66 @@
+#pragma once
+
+/*
+x86 SIMD support, read once from cpuid. The kernels that use it are built
+with per function target attributes, so the rest of the tree needs no
+-m flags and still runs on any cpu.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LUKE_X86 1
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AESNI_TARGET __attribute__((target("aes,pclmul,sse4.1")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define LUKE_X86 1
+#define SSE2_TARGET
+#define AVX2_TARGET
+#define AESNI_TARGET
+#endif
+
+namespace luke {
+
+struct cpu_features {
+  bool sse2 = false;
+  bool avx2 = false;
+  // AES-NI with carry-less multiply and SSE4.1
+  bool aesni = false;
+
+  static const cpu_features &get() {
+    static const cpu_features f = detect();
+    return f;
+  }
+
+private:
+  static cpu_features detect() {
+    cpu_features f;
+#if defined(LUKE_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    f.sse2 = (info[3] & (1 << 26)) != 0;
+    f.aesni = (info[2] & (1 << 25)) != 0 && (info[2] & (1 << 1)) != 0 &&
+              (info[2] & (1 << 19)) != 0;
+    // OSXSAVE and AVX, then the OS must save the YMM state
+    bool ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 &&
+               (_xgetbv(0) & 6) == 6;
+    if (ymm && max_leaf >= 7) {
+      __cpuidex(info, 7, 0);
+      f.avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#elif defined(LUKE_X86)
+    __builtin_cpu_init();
+    f.sse2 = __builtin_cpu_supports("sse2");
+    f.avx2 = __builtin_cpu_supports("avx2");
+    f.aesni = __builtin_cpu_supports("aes") &&
+              __builtin_cpu_supports("pclmul") &&
+              __builtin_cpu_supports("sse4.1");
+#endif
+    return f;
+  }
+};
+
+} // namespace luke
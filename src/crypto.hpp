@@ -1,132 +1,319 @@
 #pragma once 
 
 #include "common.hpp"
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/copy.hpp>
-#include <boost/iostreams/filter/zlib.hpp>
-#include <boost/iostreams/device/array.hpp>
-#include <boost/iostreams/stream.hpp>
+#include "blowfish.hpp"
+#include "cipher.hpp"
+#include "zcodec.hpp"
 
 namespace luke {
-typedef b4 uInt32;
-
-#define MAXKEYBYTES 56 /* 448 bits */
-
-typedef struct {
-  uInt32 P[16 + 2];
-  uInt32 S[4][256];
-} BLOWFISH_CTX;
-
-void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen);
-void Blowfish_Encrypt(BLOWFISH_CTX *ctx, b4 *xl, b4 *xr);
-void Blowfish_Decrypt(BLOWFISH_CTX *ctx, b4 *xl, b4 *xr);
+/*
+Blowfish_Init is 521 block encryptions and the context is 4 KB, so build
+it once per key and let every session read the same immutable copy.
+*/
+class key_schedule {
+public:
+  static std::shared_ptr<const BLOWFISH_CTX> get(const std::string &key) {
+    static std::mutex mtx;
+    static std::unordered_map<std::string, std::shared_ptr<const BLOWFISH_CTX>>
+        cache;
+    std::lock_guard<std::mutex> lock(mtx);
+    auto &ctx = cache[key];
+    if (!ctx) {
+      auto c = std::make_shared<BLOWFISH_CTX>();
+      Blowfish_Init(c.get(), (unsigned char *)(key.data()), (int)key.size());
+      ctx = c;
+    }
+    return ctx;
+  }
+};
 
 class crypto {
 public:
-  BLOWFISH_CTX ctx;
-
-  crypto(const std::string key) {
-    Blowfish_Init(&ctx, (unsigned char *)(key.data()), (int)key.size());
+  crypto(const std::string key) : ctx_(key_schedule::get(key)) {
+    // nonces start at a random point for every session, so two sessions
+    // under the same key don't share keystream, and in the lower half, so
+    // they only ever go up
+    std::random_device rd;
+    nonce_ = ((b8(rd()) << 32) | rd()) >> 1;
   }
 
+  crypto(const crypto &) = delete;
+  crypto &operator=(const crypto &) = delete;
+
   const bytes zlib_compress(const bytes &input) {
-    using namespace boost::iostreams;
-    array_source arr_src(reinterpret_cast<char const*>(input.data()), input.size());
-    filtering_istreambuf in;
-    in.push(zlib_compressor());
-    in.push(arr_src);
-    return bytes(std::istreambuf_iterator<char>{&in}, {});
+    bytes ret;
+    zlib_compress(input.data(), input.size(), ret);
+    return ret;
   }
 
-  const bytes zlib_decompress(const bytes &input) {
-    using namespace boost::iostreams;
-    array_source arr_src(reinterpret_cast<char const*>(input.data()), input.size());
-    filtering_istreambuf in;
-    in.push(zlib_decompressor());
-    in.push(arr_src);
-    return bytes(std::istreambuf_iterator<char>{&in}, {});
+  // compress into out as one zlib stream, reusing its capacity
+  void zlib_compress(const b1 *data, size_t size, bytes &out) {
+    zframe_tx_.deflate_frame(data, size, out);
   }
 
-  const bytes encrypt(const bytes &input) {
-    // input -> zlib -> blowfish
-    bytes dt = zlib_compress(input);
+  const bytes zlib_decompress(const bytes &input) {
     bytes ret;
-    b4 L, R;
-    // first 4 bytes is the real data length
-    b4 len = (b4)dt.size();
-    // then 4 bytes is reserved
-    b4 reserved = 0;
-    L = len;
-    R = reserved;
-    Blowfish_Encrypt(&ctx, &L, &R);
-    push_b4(ret, L);
-    push_b4(ret, R);
-    int pos = 0;
-    while ((pos + 8) < len) {
-      L = get_b4(dt, pos);
-      R = get_b4(dt, pos + 4);
-      Blowfish_Encrypt(&ctx, &L, &R);
-      push_b4(ret, L);
-      push_b4(ret, R);
-      pos += 8;
-    }
-    bytes left;
-    while (pos < len) {
-      left.push_back(dt[pos]);
-      pos++;
-    }
-    while ((left.size() % 8) != 0) {
-      left.push_back(0);
-    }
-    if (left.size() > 0) {
-      L = get_b4(left, 0);
-      R = get_b4(left, 4);
-      Blowfish_Encrypt(&ctx, &L, &R);
-      push_b4(ret, L);
-      push_b4(ret, R);
+    zlib_decompress(input.data(), input.size(), ret);
+    return ret;
+  }
+
+  // decompress one zlib stream into out, reusing its capacity; false on
+  // corrupt data or more than max_body() bytes
+  bool zlib_decompress(const b1 *data, size_t size, bytes &out) {
+    return zframe_rx_.inflate_frame(data, size, out, max_body_);
+  }
+
+  // body compression by codec, a stream codec carries on from the frames
+  // before it in the same direction
+  void compress(b1 codec, const b1 *data, size_t size, bytes &out) {
+    if (codec == CODEC_ZSTREAM) {
+      zstream_tx_.deflate_frame(data, size, out);
+    } else if (codec == CODEC_LZ4) {
+      lz4_.compress_frame(data, size, out);
+    } else if (codec == CODEC_ZCHUNKS) {
+      zchunks_.compress_frame(data, size, out);
+    } else {
+      zlib_compress(data, size, out);
+    }
+  }
+
+  bool decompress(b1 codec, const b1 *data, size_t size, bytes &out) {
+    if (codec == CODEC_RAW) {
+      out.assign(data, data + size);
+      return true;
+    }
+    if (codec == CODEC_ZSTREAM) {
+      return zstream_rx_.inflate_frame(data, size, out, max_body_);
+    }
+    if (codec == CODEC_LZ4) {
+      return lz4_codec::decompress_frame(data, size, out, max_body_);
     }
+    if (codec == CODEC_ZCHUNKS) {
+      return zchunks_.decompress_frame(data, size, out, max_body_);
+    }
+    return zlib_decompress(data, size, out);
+  }
+
+  // the most a frame may decompress to, what a session can be made to hold
+  size_t max_body() const { return max_body_; }
+  void set_max_body(size_t n) { max_body_ = n; }
+
+  static bool supports_codec(b1 codec) { return codec < CODEC_COUNT; }
+
+  // zlib level of the frames compressed from now on, all zlib codecs
+  void set_zlib_level(int level) {
+    zframe_tx_.set_level(level);
+    zstream_tx_.set_level(level);
+    zchunks_.set_level(level);
+  }
+
+  // threads for CODEC_ZCHUNKS bodies, nullptr does them on the caller's
+  chunk_pool *zchunk_pool() const { return zchunks_.pool(); }
+  void set_zchunk_pool(chunk_pool *pool) { zchunks_.set_pool(pool); }
+
+  const bytes encrypt(const bytes &input) {
+    bytes ret(max_encrypted_size(input.size()));
+    ret.resize(encrypt_into(input.data(), input.size(), ret.data()));
     return ret;
   }
 
   const bytes decrypt(const bytes &dt) {
-    // blowfish -> zlib -> bytes
-    if ((dt.size() % 8) != 0) {
-      std::cerr << "decrypt need 8 bytes pad" << std::endl;
-      return bytes();
-    }
     bytes ret;
-    b4 L, R;
-    b4 len;
-    for (auto pos = 0; pos < dt.size(); pos += 8) {
-      L = get_b4(dt, pos);
-      R = get_b4(dt, pos + 4);
-      Blowfish_Decrypt(&ctx, &L, &R);
-      if (pos == 0) {
-        len = L;
-      } else {
-        push_b4(ret, L);
-        push_b4(ret, R);
+    decrypt_into(dt.data(), dt.size(), ret);
+    return ret;
+  }
+
+  // input -> zlib -> blowfish ECB, dst must hold max_encrypted_size(len)
+  // bytes, returns the bytes written
+  size_t encrypt_into(const b1 *src, size_t len, b1 *dst) {
+    b8 nonce;
+    return encrypt_into(src, len, dst, CIPHER_ECB, nonce);
+  }
+
+  // blowfish ECB -> zlib -> dst, reusing the capacity of dst
+  bool decrypt_into(const b1 *src, size_t len, bytes &dst) {
+    return decrypt_into(src, len, dst, CIPHER_ECB, 0);
+  }
+
+  /*
+  input -> zlib -> cipher id, which must be supported. nonce is set to the
+  first nonce the frame uses, it goes in the header.
+  */
+  size_t encrypt_into(const b1 *src, size_t len, b1 *dst, b1 id,
+                      b8 &nonce) {
+    return encrypt_into(src, len, dst, id, CODEC_ZLIB, nonce);
+  }
+
+  bool decrypt_into(const b1 *src, size_t len, bytes &dst, b1 id,
+                    b8 nonce) {
+    return decrypt_into(src, len, dst, id, CODEC_ZLIB, nonce);
+  }
+
+  // the same with the body compression named by codec, and aad_len bytes
+  // of aad that an AEAD cipher authenticates along
+  size_t encrypt_into(const b1 *src, size_t len, b1 *dst, b1 id, b1 codec,
+                      b8 &nonce, const b1 *aad = nullptr,
+                      size_t aad_len = 0) {
+    cipher *c = get_cipher(id);
+    if (codec == CODEC_RAW) {
+      // nothing to stage, the cipher reads the input itself
+      nonce = nonce_;
+      nonce_ += c->nonces(len);
+      return c->seal(nonce, aad, aad_len, src, len, dst);
+    }
+    compress(codec, src, len, zbuf_);
+    nonce = nonce_;
+    nonce_ += c->nonces(zbuf_.size());
+    return c->seal(nonce, aad, aad_len, zbuf_.data(), zbuf_.size(), dst);
+  }
+
+  // what the last encrypt_into() that compressed made of its input, before
+  // the cipher added its tag or padding
+  size_t compressed_size() const { return zbuf_.size(); }
+
+  bool decrypt_into(const b1 *src, size_t len, bytes &dst, b1 id, b1 codec,
+                    b8 nonce, const b1 *aad = nullptr, size_t aad_len = 0) {
+    rxbuf_.assign(src, src + len);
+    return decrypt_in_place(rxbuf_.data(), len, dst, id, codec, nonce, aad,
+                            aad_len);
+  }
+
+  // decrypt_into that deciphers data itself instead of a copy of it
+  bool decrypt_in_place(b1 *data, size_t len, bytes &dst, b1 id, b1 codec,
+                        b8 nonce, const b1 *aad = nullptr,
+                        size_t aad_len = 0) {
+    dst.clear();
+    b1 *plain;
+    size_t plain_len;
+    if (!open(data, len, id, codec, nonce, aad, aad_len, plain, plain_len)) {
+      return false;
+    }
+    return decompress(codec, plain, plain_len, dst);
+  }
+
+  /*
+  decrypt_in_place a chunk at a time: open_body(), then next_chunk() until
+  done. data must stay put until then. A zlib body is inflated as the chunks
+  are asked for, so it is never whole in memory; an LZ4 block or zlib chunks
+  only decode whole, up to max_body().
+  */
+  bool open_body(b1 *data, size_t len, b1 id, b1 codec, b8 nonce,
+                 const b1 *aad = nullptr, size_t aad_len = 0) {
+    b1 *plain;
+    size_t plain_len;
+    body_inflater_ = nullptr;
+    body_out_ = 0;
+    if (!open(data, len, id, codec, nonce, aad, aad_len, plain, plain_len)) {
+      return false;
+    }
+    if (codec == CODEC_ZLIB || codec == CODEC_ZSTREAM) {
+      body_inflater_ = codec == CODEC_ZLIB ? &zframe_rx_ : &zstream_rx_;
+      return body_inflater_->start(plain, plain_len);
+    }
+    if (codec == CODEC_LZ4 || codec == CODEC_ZCHUNKS) {
+      if (!decompress(codec, plain, plain_len, decoded_)) {
+        return false;
+      }
+      plain = decoded_.data();
+      plain_len = decoded_.size();
+    }
+    body_src_ = plain;
+    body_len_ = plain_len;
+    return true;
+  }
+
+  // the next up to cap bytes of the body to dst, done once it is all out
+  bool next_chunk(b1 *dst, size_t cap, size_t &produced, bool &done) {
+    if (body_inflater_ != nullptr) {
+      if (!body_inflater_->next(dst, cap, produced, done)) {
+        return false;
+      }
+      body_out_ += produced;
+      if (body_out_ > max_body_) {
+        log_err("inflate over limit");
+        return false;
+      }
+      return true;
+    }
+    produced = std::min(cap, body_len_ - body_out_);
+    std::copy(body_src_ + body_out_, body_src_ + body_out_ + produced, dst);
+    body_out_ += produced;
+    done = body_out_ == body_len_;
+    return true;
+  }
+
+  // blowfish ECB in place over whole 8 byte blocks, no length or padding
+  void encrypt_blocks(b1 *data, size_t nblocks) {
+    Blowfish_Encrypt_Blocks(ctx_.get(), data, nblocks);
+  }
+
+  void decrypt_blocks(b1 *data, size_t nblocks) {
+    Blowfish_Decrypt_Blocks(ctx_.get(), data, nblocks);
+  }
+
+  static bool supports(b1 id) { return id < CIPHER_COUNT; }
+
+  enum : size_t { DEFAULT_MAX_BODY = 16 * 1024 * 1024 };
+
+  // the cipher for id, made on first use; nullptr if id is unknown
+  cipher *get_cipher(b1 id) {
+    if (!supports(id)) {
+      return nullptr;
+    }
+    if (!ciphers_[id]) {
+      switch (id) {
+      case CIPHER_ECB:
+        ciphers_[id].reset(new blowfish_ecb(ctx_));
+        break;
+      case CIPHER_CTR:
+        ciphers_[id].reset(new blowfish_ctr(ctx_));
+        break;
+      case CIPHER_CHACHA20_POLY1305:
+        ciphers_[id].reset(new chacha20_poly1305(ctx_));
+        break;
+      case CIPHER_AES128_GCM:
+        ciphers_[id].reset(new aes_gcm(ctx_, 16));
+        break;
+      case CIPHER_AES256_GCM:
+        ciphers_[id].reset(new aes_gcm(ctx_, 32));
+        break;
       }
     }
-    ret.resize(len);
+    return ciphers_[id].get();
+  }
+
+  // round up to whole 8 bytes blowfish blocks
+  static constexpr size_t pad8(size_t n) { return (n + 7) & ~size_t(7); }
 
-    return zlib_decompress(ret);
+  // worst case encrypt_into() output for len bytes, the largest codec
+  // bound plus the largest cipher overhead: the ECB length block and
+  // padding, or an AEAD tag
+  static constexpr size_t max_encrypted_size(size_t len) {
+    return pad8(std::max({zlib_deflater::bound(len), lz4_codec::bound(len),
+                          zlib_chunks::bound(len)})) +
+           16;
   }
 
-  static void test() {
+  // prints a line for each test, true if all of them passed
+  static bool test() {
+    bool passed = true;
     b4 L = 1, R = 2;
     BLOWFISH_CTX ctx;
     Blowfish_Init(&ctx, (unsigned char *)"TESTKEY", 7);
     Blowfish_Encrypt(&ctx, &L, &R);
     if (L == 0xDF333FD2L && R == 0x30A71BB4L)
       printf("Test encryption OK.\n");
-    else
+    else {
       printf("Test encryption failed.\n");
+      passed = false;
+    }
     Blowfish_Decrypt(&ctx, &L, &R);
     if (L == 1 && R == 2)
       printf("Test 1 OK.\n");
-    else
+    else {
       printf("Test 1 failed.\n");
+      passed = false;
+    }
       
     std::string key = "abcdefghijklmnopqrstuvwxyz";
     crypto bf(key);
@@ -135,20 +322,457 @@ public:
       printf("Test 2 OK.\n");
     } else {
       printf("Test 2 failed.\n");
+      passed = false;
     }
     dt = bytes_from_string("BLOWFISH");
     if (bf.decrypt(bf.encrypt(dt)) == dt) {
       printf("Test 3 OK.\n");
     } else {
       printf("Test 3 failed.\n");
+      passed = false;
     }
     dt = bytes_from_string("BLOWFISH1234567");
     if (bf.decrypt(bf.encrypt(dt)) == dt) {
       printf("Test 4 OK.\n");
     } else {
       printf("Test 4 failed.\n");
+      passed = false;
+    }
+    // bulk ECB must match the single block cipher, including the tail blocks
+    bytes blocks(8 * 31);
+    for (size_t i = 0; i < blocks.size(); i++) {
+      blocks[i] = (b1)(i * 7 + 3);
+    }
+    bytes expect;
+    for (size_t pos = 0; pos < blocks.size(); pos += 8) {
+      L = get_b4(blocks, (int)pos);
+      R = get_b4(blocks, (int)pos + 4);
+      blowfish::crypt<blowfish::ENCRYPT>(ctx, L, R);
+      push_b4(expect, L);
+      push_b4(expect, R);
+    }
+    bytes got = blocks;
+    Blowfish_Encrypt_Blocks(&ctx, got.data(), got.size() / 8);
+    bool ok = (got == expect);
+    Blowfish_Decrypt_Blocks(&ctx, got.data(), got.size() / 8);
+    if (ok && got == blocks) {
+      printf("Test 5 OK.\n");
+    } else {
+      printf("Test 5 failed.\n");
+      passed = false;
+    }
+    if (key_schedule::get(key) == key_schedule::get(key) &&
+        key_schedule::get(key) != key_schedule::get("TESTKEY")) {
+      printf("Test 6 OK.\n");
+    } else {
+      printf("Test 6 failed.\n");
+      passed = false;
     }
+    // CTR round trip, and any offset of the keystream on its own
+    dt = bytes_from_string("BLOWFISH CTR HAS NO PADDING, NO LENGTH BLOCK");
+    bytes ctr(max_encrypted_size(dt.size()));
+    b8 nonce;
+    ctr.resize(bf.encrypt_into(dt.data(), dt.size(), ctr.data(), CIPHER_CTR,
+                               nonce));
+    bytes plain;
+    bytes whole(100, 0), parts(100, 0);
+    blowfish_ctr ks(key_schedule::get(key));
+    ks.xor_keystream(nonce, 0, whole.data(), whole.size());
+    ks.xor_keystream(nonce, 0, parts.data(), 37);
+    ks.xor_keystream(nonce, 37, parts.data() + 37, 63);
+    if (bf.decrypt_into(ctr.data(), ctr.size(), plain, CIPHER_CTR, nonce) &&
+        plain == dt && whole == parts) {
+      printf("Test 7 OK.\n");
+    } else {
+      printf("Test 7 failed.\n");
+      passed = false;
+    }
+    // RFC 8439 2.5.2 poly1305 vector, then an AEAD round trip that must
+    // refuse a flipped bit
+    const b1 poly_key[32] = {
+        0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52,
+        0xfe, 0x42, 0xd5, 0x06, 0xa8, 0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d,
+        0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b};
+    const b1 poly_tag[16] = {0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+                             0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9};
+    std::string msg = "Cryptographic Forum Research Group";
+    POLY1305_CTX poly;
+    b1 tag[16];
+    Poly1305_Init(&poly, poly_key);
+    Poly1305_Update(&poly, (const b1 *)msg.data(), msg.size());
+    Poly1305_Final(&poly, tag);
+    dt = bytes(1000, 'C');
+    bytes aead(max_encrypted_size(dt.size()));
+    aead.resize(bf.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                CIPHER_CHACHA20_POLY1305, nonce));
+    bool opened = bf.decrypt_into(aead.data(), aead.size(), plain,
+                                  CIPHER_CHACHA20_POLY1305, nonce) &&
+                  plain == dt;
+    aead[3] ^= 1;
+    bool refused = !bf.decrypt_into(aead.data(), aead.size(), plain,
+                                    CIPHER_CHACHA20_POLY1305, nonce);
+    if (std::equal(tag, tag + 16, poly_tag) && opened && refused) {
+      printf("Test 8 OK.\n");
+    } else {
+      printf("Test 8 failed.\n");
+      passed = false;
+    }
+    // GCM spec test cases 2 and 14 (zero key, IV and block) on the
+    // AES-NI and the constant time paths, then a framed round trip
+    const b1 zero_key[32] = {0};
+    const b1 gcm128[32] = {0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92,
+                           0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78,
+                           0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd,
+                           0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf};
+    const b1 gcm256[32] = {0xce, 0xa7, 0x40, 0x3d, 0x4d, 0x60, 0x6b, 0x6e,
+                           0x07, 0x4e, 0xc5, 0xd3, 0xba, 0xf3, 0x9d, 0x18,
+                           0xd0, 0xd1, 0xc8, 0xa7, 0x99, 0x99, 0x6b, 0xf0,
+                           0x26, 0x5b, 0x98, 0xb5, 0xd4, 0x8a, 0xb9, 0x19};
+    bool vectors = true;
+    for (int ni = 0; ni < 2; ni++) {
+      b1 block[32] = {0};
+      aes_gcm a128(zero_key, 16, ni != 0), a256(zero_key, 32, ni != 0);
+      a128.seal(0, nullptr, 0, block, 16, block);
+      vectors = vectors && std::equal(block, block + 32, gcm128);
+      std::fill(block, block + 32, 0);
+      a256.seal(0, nullptr, 0, block, 16, block);
+      vectors = vectors && std::equal(block, block + 32, gcm256);
+    }
+    dt = bytes(1000, 'A');
+    aead.resize(max_encrypted_size(dt.size()));
+    aead.resize(bf.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                CIPHER_AES256_GCM, nonce));
+    opened = bf.decrypt_into(aead.data(), aead.size(), plain,
+                             CIPHER_AES256_GCM, nonce) &&
+             plain == dt;
+    aead[3] ^= 1;
+    refused = !bf.decrypt_into(aead.data(), aead.size(), plain,
+                               CIPHER_AES256_GCM, nonce);
+    if (vectors && opened && refused) {
+      printf("Test 9 OK.\n");
+    } else {
+      printf("Test 9 failed.\n");
+      passed = false;
+    }
+
+    // a stream codec keeps its window, so like frames shrink after the first
+    crypto tx("TESTKEY"), rx("TESTKEY");
+    const std::string line = "GET /index.html HTTP/1.1\r\nHost: luketun\r\n";
+    size_t stream_size = 0, frame_size = 0;
+    bool streamed = true;
+    for (int i = 0; i < 8 && streamed; i++) {
+      dt.assign(line.begin(), line.end());
+      dt.resize(i == 3 ? 0 : dt.size() + i);
+      aead.resize(max_encrypted_size(dt.size()));
+      aead.resize(tx.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                  CIPHER_CHACHA20_POLY1305, CODEC_ZSTREAM,
+                                  nonce));
+      streamed = rx.decrypt_into(aead.data(), aead.size(), plain,
+                                 CIPHER_CHACHA20_POLY1305, CODEC_ZSTREAM,
+                                 nonce) &&
+                 plain == dt;
+      stream_size += aead.size();
+      aead.resize(max_encrypted_size(dt.size()));
+      frame_size += bf.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                    CIPHER_CHACHA20_POLY1305, nonce);
+    }
+    if (streamed && stream_size < frame_size) {
+      printf("Test 10 OK.\n");
+    } else {
+      printf("Test 10 failed.\n");
+      passed = false;
+    }
+
+    // random frames stop being compressed and go out raw, text comes back
+    compress_bypass bypass;
+    std::mt19937 rng(11);
+    dt.resize(4096);
+    for (auto &c : dt) {
+      c = (b1)rng();
+    }
+    aead.resize(max_encrypted_size(dt.size()));
+    for (int i = 0; i < compress_bypass::MISSES; i++) {
+      bf.encrypt_into(dt.data(), dt.size(), aead.data(), CIPHER_CTR, nonce);
+      bypass.record(dt.size(), bf.compressed_size());
+    }
+    bool skipping = bypass.skip();
+    // a small frame that shrinks is no miss for the tag it is sealed with
+    compress_bypass small;
+    dt.assign(compress_bypass::SAMPLE_MIN, 0);
+    for (size_t i = 0; i < dt.size() * 13 / 16; i++) {
+      dt[i] = (b1)rng();
+    }
+    for (int i = 0; i < compress_bypass::MISSES; i++) {
+      bf.encrypt_into(dt.data(), dt.size(), aead.data(),
+                      CIPHER_CHACHA20_POLY1305, nonce);
+      small.record(dt.size(), bf.compressed_size());
+    }
+    bypass.record(dt.size(), dt.size() / 4);
+    aead.resize(bf.encrypt_into(dt.data(), dt.size(), aead.data(), CIPHER_CTR,
+                                CODEC_RAW, nonce));
+    opened = bf.decrypt_into(aead.data(), aead.size(), plain, CIPHER_CTR,
+                             CODEC_RAW, nonce) &&
+             plain == dt;
+    if (skipping && !bypass.skip() && !small.skip() && opened) {
+      printf("Test 11 OK.\n");
+    } else {
+      printf("Test 11 failed.\n");
+      passed = false;
+    }
+
+    // lz4 round trip, and a block that claims more than it can hold
+    dt.assign(line.begin(), line.end());
+    for (int i = 0; i < 6; i++) {
+      dt.insert(dt.end(), dt.begin(), dt.end());
+    }
+    aead.resize(max_encrypted_size(dt.size()));
+    aead.resize(bf.encrypt_into(dt.data(), dt.size(), aead.data(), CIPHER_CTR,
+                                CODEC_LZ4, nonce));
+    opened = bf.decrypt_into(aead.data(), aead.size(), plain, CIPHER_CTR,
+                             CODEC_LZ4, nonce) &&
+             plain == dt && aead.size() < dt.size() / 8;
+    bytes block;
+    lz4_codec lz4;
+    lz4.compress_frame(dt.data(), dt.size(), block);
+    block[3] = 0x7F;
+    refused = !lz4_codec::decompress_frame(block.data(), block.size(), plain,
+                                           DEFAULT_MAX_BODY);
+    if (opened && refused) {
+      printf("Test 12 OK.\n");
+    } else {
+      printf("Test 12 failed.\n");
+      passed = false;
+    }
+
+    // the zlib level changes between stream frames, and the controller
+    // steps down when compressing is slower than the link and up when not
+    bool leveled = true;
+    for (int level = 1; level <= 9 && leveled; level += 4) {
+      tx.set_zlib_level(level);
+      aead.resize(max_encrypted_size(dt.size()));
+      aead.resize(tx.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                  CIPHER_CTR, CODEC_ZSTREAM, nonce));
+      leveled = rx.decrypt_into(aead.data(), aead.size(), plain, CIPHER_CTR,
+                                CODEC_ZSTREAM, nonce) &&
+                plain == dt;
+    }
+    level_controller ctl(level_controller::DEFAULT_RUNG);
+    for (int i = 0; i < level_controller::WINDOW; i++) {
+      // 10 ns a byte to compress to half, 1 ns a byte on the wire
+      ctl.compressed(1000, 500, 1e-5);
+      ctl.drained(500, 500);
+    }
+    ctl.adjust();
+    bool down = ctl.rung() == level_controller::DEFAULT_RUNG - 1;
+    for (int i = 0; i < level_controller::WINDOW; i++) {
+      ctl.compressed(1000, 500, 1e-6);
+      ctl.drained(500, 50000);
+    }
+    ctl.adjust();
+    if (leveled && down && ctl.rung() == level_controller::DEFAULT_RUNG) {
+      printf("Test 13 OK.\n");
+    } else {
+      printf("Test 13 failed.\n");
+      passed = false;
+    }
+
+    // bodies read in chunks come back whole, one that decompresses past
+    // max_body is refused either way
+    bool chunked = true;
+    for (b1 codec : {CODEC_ZLIB, CODEC_ZSTREAM, CODEC_RAW, CODEC_LZ4}) {
+      aead.resize(max_encrypted_size(dt.size()));
+      aead.resize(tx.encrypt_into(dt.data(), dt.size(), aead.data(),
+                                  CIPHER_CTR, codec, nonce));
+      bool done = false;
+      plain.clear();
+      chunked = chunked && rx.open_body(aead.data(), aead.size(), CIPHER_CTR,
+                                        codec, nonce);
+      while (chunked && !done) {
+        b1 chunk[1000];
+        size_t n;
+        chunked = rx.next_chunk(chunk, sizeof(chunk), n, done) &&
+                  n <= sizeof(chunk);
+        plain.insert(plain.end(), chunk, chunk + n);
+      }
+      chunked = chunked && plain == dt;
+    }
+    bytes bomb(4 * 1024 * 1024, 0);
+    aead.resize(max_encrypted_size(bomb.size()));
+    aead.resize(bf.encrypt_into(bomb.data(), bomb.size(), aead.data(),
+                                CIPHER_CTR, nonce));
+    bf.set_max_body(1024 * 1024);
+    refused = !bf.decrypt_into(aead.data(), aead.size(), plain, CIPHER_CTR,
+                               nonce);
+    bool capped = bf.open_body(aead.data(), aead.size(), CIPHER_CTR,
+                               CODEC_ZLIB, nonce);
+    plain.resize(64 * 1024);
+    for (bool done = false; capped && !done;) {
+      size_t n;
+      capped = bf.next_chunk(plain.data(), plain.size(), n, done);
+    }
+    if (chunked && refused && !capped) {
+      printf("Test 14 OK.\n");
+    } else {
+      printf("Test 14 failed.\n");
+      passed = false;
+    }
+
+    // a large body deflates the same in chunks on a pool as on one thread,
+    // decodes with or without one and is refused past max_body
+    dt.clear();
+    for (int i = 0; dt.size() < 5 * zlib_chunks::CHUNK + 100; i++) {
+      std::string l = line + std::to_string(i * 7919);
+      dt.insert(dt.end(), l.begin(), l.end());
+    }
+    bytes pooled, serial, chunks;
+    {
+      chunk_pool pool(3);
+      tx.set_zchunk_pool(&pool);
+      pooled.resize(max_encrypted_size(dt.size()));
+      pooled.resize(tx.encrypt_into(dt.data(), dt.size(), pooled.data(),
+                                    CIPHER_CTR, CODEC_ZCHUNKS, nonce));
+      rx.set_zchunk_pool(&pool);
+      opened = rx.decrypt_into(pooled.data(), pooled.size(), plain,
+                               CIPHER_CTR, CODEC_ZCHUNKS, nonce) &&
+               plain == dt;
+      tx.compress(CODEC_ZCHUNKS, dt.data(), dt.size(), chunks);
+      tx.set_zchunk_pool(nullptr);
+      rx.set_zchunk_pool(nullptr);
+    }
+    zlib_chunks one;
+    one.set_level(9); // where Test 13 left tx
+    one.compress_frame(dt.data(), dt.size(), serial);
+    bool same = chunks == serial &&
+                get_b4(serial.data()) == zlib_chunks::count(dt.size());
+    opened = opened && one.decompress_frame(serial.data(), serial.size(),
+                                            plain, DEFAULT_MAX_BODY) &&
+             plain == dt;
+    refused = !one.decompress_frame(serial.data(), serial.size(), plain,
+                                    2 * zlib_chunks::CHUNK);
+    put_b4(serial.data() + 4, get_b4(serial.data() + 4) + 1);
+    refused = refused && !one.decompress_frame(serial.data(), serial.size(),
+                                               plain, DEFAULT_MAX_BODY);
+    if (opened && same && refused) {
+      printf("Test 15 OK.\n");
+    } else {
+      printf("Test 15 failed.\n");
+      passed = false;
+    }
+
+    // RFC 8439 2.8.2 and GCM spec test case 4, both with associated data,
+    // and a sealed body that moves under other header fields is refused
+    const b1 cc_key[32] = {
+        0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b,
+        0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+        0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f};
+    const b1 cc_nonce[12] = {
+        0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    const b1 cc_aad[12] = {
+        0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    const b1 cc_tag[16] = {
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb,
+        0xd0, 0x60, 0x06, 0x91};
+    const b1 gcm_key[16] = {
+        0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94,
+        0x67, 0x30, 0x83, 0x08};
+    const b1 gcm_iv[12] = {
+        0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88};
+    const b1 gcm_aad[20] = {
+        0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce,
+        0xde, 0xad, 0xbe, 0xef, 0xab, 0xad, 0xda, 0xd2};
+    const b1 gcm_tag[16] = {
+        0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb, 0x94, 0xfa, 0xe9, 0x5a,
+        0xe7, 0x12, 0x1a, 0x47};
+    const b1 gcm_plain[60] = {
+        0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5,
+        0xaf, 0xf5, 0x26, 0x9a, 0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda,
+        0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72, 0x1c, 0x3c, 0x0c, 0x95,
+        0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+        0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39};
+    msg = "Ladies and Gentlemen of the class of '99: If I could offer you "
+          "only one tip for the future, sunscreen would be it.";
+    chacha20_poly1305 cc(cc_key);
+    dt.assign(msg.begin(), msg.end());
+    ChaCha20_Xor(cc_key, cc_nonce, 1, dt.data(), dt.data(), dt.size());
+    cc.mac(cc_nonce, cc_aad, sizeof(cc_aad), dt.data(), dt.size(), tag);
+    vectors = std::equal(tag, tag + 16, cc_tag);
+    for (int ni = 0; ni < 2; ni++) {
+      AES_GCM_CTX gcm;
+      b1 sealed[sizeof(gcm_plain)];
+      AES_GCM_Init(&gcm, gcm_key, 16, ni != 0);
+      AES_GCM_Seal(&gcm, gcm_iv, gcm_aad, sizeof(gcm_aad), gcm_plain, sealed,
+                   sizeof(gcm_plain), tag);
+      vectors = vectors && std::equal(tag, tag + 16, gcm_tag);
+    }
+    bool bound = true;
+    for (b1 id : {CIPHER_CHACHA20_POLY1305, CIPHER_AES128_GCM}) {
+      dt = bytes(100, 'H');
+      aead.resize(max_encrypted_size(dt.size()));
+      aead.resize(bf.encrypt_into(dt.data(), dt.size(), aead.data(), id,
+                                  CODEC_RAW, nonce, cc_aad, sizeof(cc_aad)));
+      b1 moved[sizeof(cc_aad)];
+      std::copy(cc_aad, cc_aad + sizeof(cc_aad), moved);
+      moved[4] ^= 1;
+      bound = bound &&
+              !bf.decrypt_into(aead.data(), aead.size(), plain, id, CODEC_RAW,
+                               nonce, moved, sizeof(moved)) &&
+              bf.decrypt_into(aead.data(), aead.size(), plain, id, CODEC_RAW,
+                              nonce, cc_aad, sizeof(cc_aad)) &&
+              plain == dt;
+    }
+    if (vectors && bound) {
+      printf("Test 16 OK.\n");
+    } else {
+      printf("Test 16 failed.\n");
+      passed = false;
+    }
+    return passed;
+  }
+
+private:
+  // authenticate and decipher data in place, plain points into it
+  bool open(b1 *data, size_t len, b1 id, b1 codec, b8 nonce, const b1 *aad,
+            size_t aad_len, b1 *&plain, size_t &plain_len) {
+    cipher *c = get_cipher(id);
+    if (c == nullptr) {
+      std::cerr << "decrypt unknown cipher " << (int)id << std::endl;
+      return false;
+    }
+    if (!c->open(nonce, aad, aad_len, data, len, plain, plain_len)) {
+      return false;
+    }
+    if (!supports_codec(codec)) {
+      std::cerr << "decrypt unknown codec " << (int)codec << std::endl;
+      return false;
+    }
+    return true;
   }
+
+  std::shared_ptr<const BLOWFISH_CTX> ctx_;
+  // next unused nonce of this side
+  b8 nonce_;
+  std::unique_ptr<cipher> ciphers_[CIPHER_COUNT];
+  // compressed output before the cipher
+  bytes zbuf_;
+  // the copy decrypt_into() deciphers
+  bytes rxbuf_;
+  // headers and CODEC_ZLIB bodies
+  zlib_deflater zframe_tx_{false};
+  zlib_inflater zframe_rx_{false};
+  // CODEC_ZSTREAM bodies, one stream per direction
+  zlib_deflater zstream_tx_{true};
+  zlib_inflater zstream_rx_{true};
+  // CODEC_LZ4 bodies
+  lz4_codec lz4_;
+  // CODEC_ZCHUNKS bodies
+  zlib_chunks zchunks_;
+  size_t max_body_ = DEFAULT_MAX_BODY;
+  // the body open_body() started
+  zlib_inflater *body_inflater_ = nullptr;
+  const b1 *body_src_ = nullptr;
+  size_t body_len_ = 0;
+  size_t body_out_ = 0;
+  bytes decoded_;
 };
 
 } // namespace luke
@@ -0,0 +1,752 @@
+#pragma once
+
+#include "common.hpp"
+#include "cpu.hpp"
+#include "crypto.hpp"
+
+namespace luke {
+
+/* frame header, encrypted with crypto::encrypt_into
+  ver b4: 20180517
+  cmd b4, or cmd result b4 in a response
+  crypto body data len b4
+  peers before CTR only read the 12 bytes above, the rest is ignored there
+  flags b4: body cipher in the low byte, body codec in the next one
+  caps b4: what the sender can decode
+  nonce b8: first nonce of the body cipher
+  stream b4: the stream of a multiplexed tunnel, 0 on a tunnel of one stream
+  peers before streams only read the 28 bytes above
+
+  the compact form, two blowfish blocks sent as they are
+  cmd b2
+  flags b2
+  crypto body data len b4
+  nonce b8
+  ver and caps are left out, caps stay what the last full header said
+  with a stream, a third block
+  stream b4
+  zero b4
+*/
+struct frame_header {
+  enum {
+    LEGACY_SIZE = 12,
+    STREAMLESS_SIZE = 28,
+    SIZE = 32,
+    COMPACT_SIZE = 16,
+    STREAM_COMPACT_SIZE = 24,
+    AAD_SIZE = 20
+  };
+
+  b4 ver = VER;
+  b4 cmd = 0;
+  b4 body_len = 0;
+  b4 flags = CIPHER_ECB;
+  b4 caps = 0;
+  b8 nonce = 0;
+  b4 stream = 0;
+
+  b1 cipher() const { return flags & 0xFF; }
+  b1 codec() const { return (flags >> 8) & 0xFF; }
+
+  void encode(b1 *p) const {
+    put_b4(p, ver);
+    put_b4(p + 4, cmd);
+    put_b4(p + 8, body_len);
+    put_b4(p + 12, flags);
+    put_b4(p + 16, caps);
+    put_b8(p + 20, nonce);
+    put_b4(p + 28, stream);
+  }
+
+  /*
+  What an AEAD body is sealed with, the fields it belongs to in either
+  form of the header. The cipher covers the nonce and the body length
+  itself.
+  */
+  void encode_aad(b1 *p) const {
+    put_b4(p, ver);
+    put_b4(p + 4, cmd);
+    put_b4(p + 8, flags);
+    put_b4(p + 12, caps);
+    put_b4(p + 16, stream);
+  }
+
+  // whether the compact form can hold this header
+  bool compact() const { return cmd <= 0xFFFF && flags <= 0xFFFF; }
+
+  // COMPACT_SIZE bytes, or STREAM_COMPACT_SIZE with a stream
+  size_t compact_size() const {
+    return stream == 0 ? COMPACT_SIZE : STREAM_COMPACT_SIZE;
+  }
+
+  void encode_compact(b1 *p) const {
+    put_b2(p, (b2)cmd);
+    put_b2(p + 2, (b2)flags);
+    put_b4(p + 4, body_len);
+    put_b8(p + 8, nonce);
+    if (stream != 0) {
+      put_b4(p + 16, stream);
+      put_b4(p + 20, 0);
+    }
+  }
+
+  void decode_compact(const b1 *p, size_t size, b4 peer_caps) {
+    ver = VER;
+    cmd = get_b2(p);
+    flags = get_b2(p + 2);
+    body_len = get_b4(p + 4);
+    nonce = get_b8(p + 8);
+    caps = peer_caps;
+    stream = size >= STREAM_COMPACT_SIZE ? get_b4(p + 16) : 0;
+  }
+
+  bool decode(const bytes &h) {
+    if (h.size() < LEGACY_SIZE) {
+      return false;
+    }
+    ver = get_b4(h, 0);
+    cmd = get_b4(h, 4);
+    body_len = get_b4(h, 8);
+    if (h.size() < STREAMLESS_SIZE) {
+      // an old peer, ECB only
+      flags = CIPHER_ECB;
+      caps = 0;
+      nonce = 0;
+      stream = 0;
+      return true;
+    }
+    flags = get_b4(h, 12);
+    caps = get_b4(h, 16);
+    nonce = get_b8(h, 20);
+    stream = h.size() < SIZE ? 0 : get_b4(h, 28);
+    return true;
+  }
+};
+
+// how the sessions of a tun client or server encode their bodies
+struct codec_options {
+  // what an initiator asks for, zlib when the peer can't decode it
+  b1 body_codec = CODEC_ZSTREAM;
+  // let a level_controller pick the codec and zlib level as it goes
+  bool adaptive = false;
+  // the most a received frame may decompress to
+  size_t max_body = crypto::DEFAULT_MAX_BODY;
+  // advertise CAP_LARGE_FRAMES, which max_body must allow
+  bool large_frames = false;
+  // threads that deflate the chunks of large zlib bodies, nullptr sends
+  // them whole
+  chunk_pool *zchunk_pool = nullptr;
+};
+
+/*
+One end of a tunnel connection: the crypto, the outgoing frame buffer and
+what the peer can decode. Every header advertises our caps. The initiator
+(tun client) picks the body cipher and codec from the caps in the peer's last
+header, the responder (tun server) answers in the cipher and codec of the
+last request, so an old peer on either side only ever gets ECB and zlib.
+Bodies that don't compress go out raw when the peer takes CAP_RAW. An
+adaptive codec moves between LZ4 and the zlib levels as its level_controller
+says, within what the peer can decode. With a chunk_pool a large zlib body
+goes out as CODEC_ZCHUNKS, deflated on several threads. Headers are ECB and
+zlib per frame, or the compact header once the peer has
+CAP_COMPACT_HEADER. A frame names the stream it belongs to, which only a
+peer with CAP_STREAMS tells apart.
+*/
+class frame_codec {
+public:
+  enum {
+    LOCAL_CAPS = CAP_CTR | CAP_CHACHA20_POLY1305 | CAP_AES_GCM | CAP_ZSTREAM |
+                 CAP_RAW | CAP_LZ4 | CAP_COMPACT_HEADER | CAP_ZCHUNKS |
+                 CAP_STREAMS | CAP_CREDITS
+  };
+  // how much of a body a relay decodes at once
+  enum { BODY_CHUNK = 16 * 1024 };
+  /*
+  A compact head is COMPACT_MARK, or STREAM_MARK with a stream, where the
+  length of a full header would be and then the compact header. Other heads
+  are longer, so a reader takes HEAD_MIN bytes, then head_size() - HEAD_MIN
+  more for decode_head().
+  */
+  enum {
+    COMPACT_MARK = 0xFFFF,
+    STREAM_MARK = 0xFFFE,
+    HEAD_MIN = 2 + frame_header::COMPACT_SIZE
+  };
+
+  frame_codec(const std::string &key, bool initiator,
+              const codec_options &opts = codec_options())
+      : crp(key), initiator_(initiator), want_codec_(opts.body_codec) {
+    crp.set_max_body(opts.max_body);
+    // constant time AES is slower than chacha20, so only offer it with AES-NI
+    if (!cpu_features::get().aesni) {
+      local_caps_ &= ~CAP_AES_GCM;
+    }
+    if (opts.large_frames && opts.max_body >= LARGE_FRAME_SIZE) {
+      local_caps_ |= CAP_LARGE_FRAMES;
+    }
+    crp.set_zchunk_pool(opts.zchunk_pool);
+    if (opts.adaptive) {
+      ctl_.reset(new level_controller(want_codec_ == CODEC_LZ4
+                                          ? level_controller::LZ4_RUNG
+                                          : level_controller::DEFAULT_RUNG));
+    }
+  }
+
+  // the head and the body of an encoded frame, sent in one gather write
+  typedef std::array<boost::asio::const_buffer, 2> buffers;
+
+  /*
+  crypto header length: 2 bytes
+  crypto header data
+  crypto real body data
+  or a mark, the compact header and the body. The head and the body
+  are encrypted straight into buffers of their own that keep their size, so
+  nothing is copied or allocated once the body buffer has grown. Both stay
+  valid until the next encode().
+  */
+  buffers encode(b4 cmd, const b1 *body_data, size_t len, b4 stream = 0) {
+    if (body_.size() < crypto::max_encrypted_size(len)) {
+      body_.resize(crypto::max_encrypted_size(len));
+    }
+    frame_header h;
+    b1 codec = ctl_ ? adaptive_codec() : tx_codec_;
+    if (codec != CODEC_LZ4 && len >= zlib_chunks::PARALLEL_MIN &&
+        crp.zchunk_pool() != nullptr && (peer_caps_ & CAP_ZCHUNKS)) {
+      codec = CODEC_ZCHUNKS;
+    }
+    if ((peer_caps_ & CAP_RAW) && bypass_.skip()) {
+      codec = CODEC_RAW;
+    }
+    h.cmd = cmd;
+    h.stream = stream;
+    h.flags = tx_cipher_ | (b4(codec) << 8);
+    h.caps = local_caps_;
+    b1 aad[frame_header::AAD_SIZE];
+    h.encode_aad(aad);
+    auto start = std::chrono::steady_clock::now();
+    h.body_len = (b4)crp.encrypt_into(body_data, len, body_.data(),
+                                      tx_cipher_, codec, h.nonce, aad,
+                                      sizeof(aad));
+    if (codec != CODEC_RAW) {
+      bypass_.record(len, crp.compressed_size());
+      if (ctl_) {
+        std::chrono::duration<double> took =
+            std::chrono::steady_clock::now() - start;
+        ctl_->compressed(len, h.body_len, took.count());
+        ctl_->adjust();
+      }
+    }
+    auto body = boost::asio::buffer(body_.data(), h.body_len);
+    // the compact header leaves out our caps, so it only follows a full one
+    if ((peer_caps_ & CAP_COMPACT_HEADER) && sent_caps_ && h.compact() &&
+        (stream == 0 || (peer_caps_ & CAP_STREAMS))) {
+      size_t size = h.compact_size();
+      put_b2(head_, stream == 0 ? COMPACT_MARK : STREAM_MARK);
+      h.encode_compact(head_ + 2);
+      crp.encrypt_blocks(head_ + 2, size / 8);
+      return buffers{{boost::asio::buffer(head_, 2 + size), body}};
+    }
+    b1 header_data[frame_header::SIZE];
+    h.encode(header_data);
+    size_t header_size =
+        crp.encrypt_into(header_data, sizeof(header_data), head_ + 2);
+    put_b2(head_, (b2)header_size); // header length
+    sent_caps_ = true;
+    return buffers{{boost::asio::buffer(head_, 2 + header_size), body}};
+  }
+
+  // bytes of the head that starts with these HEAD_MIN bytes, 0 if no head
+  // starts like that
+  static size_t head_size(const b1 *p) {
+    size_t n = get_b2(p);
+    if (n == COMPACT_MARK) {
+      return HEAD_MIN;
+    }
+    if (n == STREAM_MARK) {
+      return 2 + frame_header::STREAM_COMPACT_SIZE;
+    }
+    return 2 + n >= HEAD_MIN ? 2 + n : 0;
+  }
+
+  // a whole head of either form, length prefix included
+  bool decode_head(const b1 *head, size_t len, frame_header &h) {
+    b2 mark = len >= 2 ? get_b2(head) : 0;
+    if ((mark == COMPACT_MARK || mark == STREAM_MARK) &&
+        len == head_size(head)) {
+      b1 block[frame_header::STREAM_COMPACT_SIZE];
+      std::copy(head + 2, head + len, block);
+      crp.decrypt_blocks(block, (len - 2) / 8);
+      h.decode_compact(block, len - 2, peer_caps_);
+      follow_peer(h);
+      return body_fits(h);
+    }
+    return len >= 2 && decode_header(head + 2, len - 2, h) && body_fits(h);
+  }
+
+  // decrypt the header data and follow what the peer says it can do
+  bool decode_header(const b1 *data, size_t len, frame_header &h) {
+    if (!crp.decrypt_into(data, len, header_) || !h.decode(header_)) {
+      return false;
+    }
+    follow_peer(h);
+    return true;
+  }
+
+  // the first of the preferred ciphers the peer can decode, AES-GCM only
+  // when this cpu has AES-NI, chacha20 is faster than constant time AES
+  static b1 choose_cipher(b4 peer_caps) {
+    if ((peer_caps & CAP_AES_GCM) && cpu_features::get().aesni) {
+      return CIPHER_AES256_GCM;
+    }
+    if (peer_caps & CAP_CHACHA20_POLY1305) {
+      return CIPHER_CHACHA20_POLY1305;
+    }
+    if (peer_caps & CAP_CTR) {
+      return CIPHER_CTR;
+    }
+    return CIPHER_ECB;
+  }
+
+  b1 choose_codec(b4 peer_caps) const {
+    if ((want_codec_ == CODEC_ZSTREAM && (peer_caps & CAP_ZSTREAM)) ||
+        (want_codec_ == CODEC_LZ4 && (peer_caps & CAP_LZ4))) {
+      return want_codec_;
+    }
+    return CODEC_ZLIB;
+  }
+
+  // a write of an encoded frame to socket finished, on the io thread
+  template <class Socket>
+  void written(Socket &socket, size_t bytes,
+               std::chrono::steady_clock::duration took) {
+    if (ctl_) {
+      link_.written(
+          socket, bytes,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(took).count(),
+          *ctl_);
+    }
+  }
+
+  bool decode_body(const frame_header &h, const b1 *data, size_t len,
+                   bytes &out) {
+    b1 aad[frame_header::AAD_SIZE];
+    h.encode_aad(aad);
+    if (!fresh(h) || !crp.decrypt_into(data, len, out, h.cipher(), h.codec(),
+                                       h.nonce, aad, sizeof(aad))) {
+      return false;
+    }
+    spend_nonces(h, len);
+    return true;
+  }
+
+  // decode_body that deciphers data itself instead of a copy of it
+  bool decode_body_in_place(const frame_header &h, b1 *data, size_t len,
+                            bytes &out) {
+    b1 aad[frame_header::AAD_SIZE];
+    h.encode_aad(aad);
+    if (!fresh(h) ||
+        !crp.decrypt_in_place(data, len, out, h.cipher(), h.codec(), h.nonce,
+                              aad, sizeof(aad))) {
+      return false;
+    }
+    spend_nonces(h, len);
+    return true;
+  }
+
+  // decode_body_in_place a chunk at a time, see crypto::open_body
+  bool open_body(const frame_header &h, b1 *data, size_t len) {
+    b1 aad[frame_header::AAD_SIZE];
+    h.encode_aad(aad);
+    if (!fresh(h) || !crp.open_body(data, len, h.cipher(), h.codec(),
+                                    h.nonce, aad, sizeof(aad))) {
+      return false;
+    }
+    spend_nonces(h, len);
+    return true;
+  }
+
+  bool next_chunk(b1 *dst, size_t cap, size_t &produced, bool &done) {
+    return crp.next_chunk(dst, cap, produced, done);
+  }
+
+  // prints a line for each test, true if all of them passed
+  static bool test() {
+    bool passed = true;
+    const std::string key = "@@abort();";
+    frame_codec client(key, true), server(key, false);
+    bytes dt = bytes_from_string("frame header round trip");
+    // from encodes a frame that to decodes, the head has the mark given
+    // or, with 0, is a full one
+    auto pass = [&dt](frame_codec &from, frame_codec &to, b4 cmd, b4 stream,
+                      b2 mark) {
+      bytes wire;
+      for (auto &b : from.encode(cmd, dt.data(), dt.size(), stream)) {
+        const b1 *p = static_cast<const b1 *>(b.data());
+        wire.insert(wire.end(), p, p + b.size());
+      }
+      size_t head_len = head_size(wire.data());
+      frame_header h;
+      bytes out;
+      return head_len > 0 && head_len <= wire.size() &&
+             (mark == 0 ? get_b2(wire.data()) < STREAM_MARK
+                        : get_b2(wire.data()) == mark) &&
+             to.decode_head(wire.data(), head_len, h) && h.cmd == cmd &&
+             h.stream == stream && h.body_len == wire.size() - head_len &&
+             to.decode_body(h, wire.data() + head_len, h.body_len, out) &&
+             out == dt;
+    };
+    // full heads until each side has heard the other, then compact ones
+    bool heads = pass(client, server, GET_URL, 0, 0) &&
+                 pass(server, client, OK, 0, 0) &&
+                 pass(client, server, SOCKS_CONNECT, 0, COMPACT_MARK) &&
+                 pass(client, server, SOCKS_CONNECT, 7, STREAM_MARK) &&
+                 pass(server, client, OK, 7, STREAM_MARK) &&
+                 pass(server, client, OK, 0, COMPACT_MARK) &&
+                 // a cmd past b2 only fits a full head
+                 pass(client, server, 0x10000, 7, 0);
+    if (heads) {
+      printf("Test 17 OK.\n");
+    } else {
+      printf("Test 17 failed.\n");
+      passed = false;
+    }
+
+    // a frame decoded once is refused the second time
+    auto frame = client.encode(SOCKS_CONNECT, dt.data(), dt.size(), 3);
+    bytes wire;
+    for (auto &b : frame) {
+      const b1 *p = static_cast<const b1 *>(b.data());
+      wire.insert(wire.end(), p, p + b.size());
+    }
+    size_t head_len = head_size(wire.data());
+    frame_header h;
+    bytes out;
+    bool once = server.decode_head(wire.data(), head_len, h) &&
+                server.decode_body(h, wire.data() + head_len, h.body_len, out);
+    bool twice = server.decode_head(wire.data(), head_len, h) &&
+                 server.decode_body(h, wire.data() + head_len, h.body_len, out);
+    if (once && !twice) {
+      printf("Test 18 OK.\n");
+    } else {
+      printf("Test 18 failed.\n");
+      passed = false;
+    }
+    return passed;
+  }
+
+private:
+  // no body longer than the most max_body() bytes encode to is decodable,
+  // so a reader never has to make room for one
+  bool body_fits(const frame_header &h) const {
+    if (h.body_len > crypto::max_encrypted_size(crp.max_body())) {
+      log_err("frame body too long");
+      return false;
+    }
+    return true;
+  }
+
+  /*
+  The peer's nonces only go up, so a body under a nonce below the end of
+  the last one is a recorded frame played again. ECB takes no nonce.
+  */
+  bool fresh(const frame_header &h) const {
+    if (h.cipher() != CIPHER_ECB && rx_started_ && h.nonce < rx_nonce_) {
+      log_err("frame nonce replayed");
+      return false;
+    }
+    return true;
+  }
+
+  // the nonces of a decoded body of len bytes are spent
+  void spend_nonces(const frame_header &h, size_t len) {
+    if (h.cipher() != CIPHER_ECB) {
+      b8 used = crp.get_cipher(h.cipher())->nonces(len);
+      rx_nonce_ = h.nonce + std::max<b8>(used, 1);
+      rx_started_ = true;
+    }
+  }
+
+  void follow_peer(const frame_header &h) {
+    peer_caps_ = h.caps;
+    if (initiator_) {
+      tx_cipher_ = choose_cipher(h.caps);
+      tx_codec_ = choose_codec(h.caps);
+    } else {
+      if (crypto::supports(h.cipher())) {
+        tx_cipher_ = h.cipher();
+      }
+      // raw and chunked bodies are the peer's choice for that frame only
+      if (crypto::supports_codec(h.codec()) && h.codec() != CODEC_RAW &&
+          h.codec() != CODEC_ZCHUNKS) {
+        tx_codec_ = h.codec();
+      }
+    }
+  }
+
+  // the codec of the controller's rung, setting the zlib level for it
+  b1 adaptive_codec() {
+    int rung = ctl_->rung();
+    if (rung == level_controller::LZ4_RUNG && (peer_caps_ & CAP_LZ4)) {
+      return CODEC_LZ4;
+    }
+    crp.set_zlib_level(std::max(rung, 1));
+    if (tx_codec_ != CODEC_LZ4) {
+      return tx_codec_;
+    }
+    return (peer_caps_ & CAP_ZSTREAM) ? CODEC_ZSTREAM : CODEC_ZLIB;
+  }
+
+  crypto crp;
+  bool initiator_;
+  b1 want_codec_;
+  b1 tx_cipher_ = CIPHER_ECB;
+  b1 tx_codec_ = CODEC_ZLIB;
+  b4 peer_caps_ = 0;
+  // the lowest nonce the peer's next body may use, once there was one
+  b8 rx_nonce_ = 0;
+  bool rx_started_ = false;
+  // what we can decode: LOCAL_CAPS, less CAP_AES_GCM without AES-NI, and
+  // CAP_LARGE_FRAMES if asked for and max_body allows
+  b4 local_caps_ = LOCAL_CAPS;
+  // a full header with local_caps_ went out
+  bool sent_caps_ = false;
+  compress_bypass bypass_;
+  // nullptr unless adaptive
+  std::unique_ptr<level_controller> ctl_;
+  // how fast the socket drains, for ctl_
+  link_meter link_;
+  bytes header_;
+  // the head and the body encode() made last
+  b1 head_[2 + crypto::max_encrypted_size(frame_header::SIZE)];
+  bytes body_;
+};
+
+/*
+The receive side of a tunnel socket. A read takes whatever the socket has
+into the free end of one buffer, often several frames at once, and the
+session takes frames off the front without reading again until it runs
+short. Frames are decoded where they lie, so a partial frame at the end is
+moved back to the start instead of wrapping around, once it would not fit
+or the free end gets small. The buffer starts small and left uninitialized,
+and only grows for a frame larger than it, so an idle session costs little.
+*/
+class frame_reader {
+public:
+  enum : size_t { INITIAL_SIZE = 32 * 1024, MIN_ROOM = 4 * 1024 };
+
+  frame_reader() : buf_(new b1[INITIAL_SIZE]), capacity_(INITIAL_SIZE) {}
+
+  frame_reader(const frame_reader &) = delete;
+  frame_reader &operator=(const frame_reader &) = delete;
+
+  // what was read and not consumed yet
+  const b1 *data() const { return buf_.get() + begin_; }
+  b1 *data() { return buf_.get() + begin_; }
+  size_t size() const { return end_ - begin_; }
+
+  // the first n bytes of data() are done with
+  void consume(size_t n) {
+    begin_ += n;
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    }
+  }
+
+  // the free end for the next read, with room for data() to reach n bytes
+  boost::asio::mutable_buffer prepare(size_t n) {
+    if (n > capacity_) {
+      // at least twice as large, so a run of growing frames copies little
+      size_t capacity = std::max(n, 2 * capacity_);
+      std::unique_ptr<b1[]> buf(new b1[capacity]);
+      std::copy(buf_.get() + begin_, buf_.get() + end_, buf.get());
+      buf_ = std::move(buf);
+      capacity_ = capacity;
+      end_ -= begin_;
+      begin_ = 0;
+    } else if (begin_ + n > capacity_ ||
+               (begin_ > 0 && capacity_ - end_ < MIN_ROOM)) {
+      std::copy(buf_.get() + begin_, buf_.get() + end_, buf_.get());
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    return boost::asio::buffer(buf_.get() + end_, capacity_ - end_);
+  }
+
+  // a read put n bytes into the buffer prepare() gave
+  void commit(size_t n) { end_ += n; }
+
+  // prints a line for each test, true if all of them passed
+  static bool test() {
+    const std::string key = "@@abort();";
+    frame_codec client(key, true), server(key, false);
+    std::mt19937 rng(2484);
+    // frames that straddle the end of the buffer, and one larger than it
+    std::vector<bytes> sent;
+    bytes wire;
+    for (size_t len : {20000, 20000, 20000, 100000, 30000, 5}) {
+      bytes dt(len);
+      for (auto &c : dt) {
+        c = (b1)rng();
+      }
+      for (auto &b : client.encode(SOCKS_CONNECT, dt.data(), dt.size())) {
+        const b1 *p = static_cast<const b1 *>(b.data());
+        wire.insert(wire.end(), p, p + b.size());
+      }
+      sent.push_back(std::move(dt));
+    }
+    frame_reader r;
+    size_t pos = 0;
+    // like read_frame(), with reads of at most 7001 bytes
+    auto read = [&](size_t n) {
+      while (r.size() < n && pos < wire.size()) {
+        auto buf = r.prepare(n);
+        size_t k = std::min({boost::asio::buffer_size(buf), size_t(7001),
+                             wire.size() - pos});
+        std::copy(wire.begin() + pos, wire.begin() + pos + k,
+                  static_cast<b1 *>(buf.data()));
+        pos += k;
+        r.commit(k);
+      }
+      return r.size() >= n;
+    };
+    bool whole = true;
+    for (auto &dt : sent) {
+      frame_header h;
+      bytes out;
+      size_t head_len = read(frame_codec::HEAD_MIN)
+                            ? frame_codec::head_size(r.data())
+                            : 0;
+      whole = whole && head_len > 0 && read(head_len) &&
+              server.decode_head(r.data(), head_len, h);
+      if (!whole) {
+        break;
+      }
+      r.consume(head_len);
+      whole = read(h.body_len) &&
+              server.decode_body_in_place(h, r.data(), h.body_len, out) &&
+              out == dt;
+      r.consume(h.body_len);
+    }
+    // grown once for the large frame, and empty at the end
+    if (whole && r.size() == 0 && r.capacity_ < 2 * 100000 + INITIAL_SIZE) {
+      printf("Test 19 OK.\n");
+      return true;
+    }
+    printf("Test 19 failed.\n");
+    return false;
+  }
+
+private:
+  std::unique_ptr<b1[]> buf_;
+  size_t capacity_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+/*
+The far end of a tunnel in the tests of tun_client and tun_server. Once
+socket() is connected, start() hands it every frame read, and send()
+queues frames out behind the ones before, so nothing the test does waits
+on the end under test.
+*/
+class test_peer {
+public:
+  typedef std::function<bool(const frame_header &, const bytes &)> handler;
+
+  test_peer(boost::asio::io_service &io, bool initiator)
+      : socket_(io), codec_("@@abort();", initiator) {}
+
+  boost::asio::ip::tcp::socket &socket() { return socket_; }
+
+  // on gets each frame until it returns false or the connection is gone
+  void start(handler on) {
+    on_ = std::move(on);
+    read();
+  }
+
+  void send(b4 cmd, b4 stream, const b1 *data = nullptr, size_t len = 0) {
+    bytes frame;
+    for (auto &b : codec_.encode(cmd, data, len, stream)) {
+      const b1 *p = static_cast<const b1 *>(b.data());
+      frame.insert(frame.end(), p, p + b.size());
+    }
+    out_.push_back(std::move(frame));
+    if (out_.size() == 1) {
+      write();
+    }
+  }
+
+private:
+  void read() {
+    while (true) {
+      if (head_len_ == 0) {
+        if (frames_.size() < frame_codec::HEAD_MIN) {
+          break;
+        }
+        head_len_ = frame_codec::head_size(frames_.data());
+        if (head_len_ == 0) {
+          return;
+        }
+      }
+      if (!headed_) {
+        if (frames_.size() < head_len_) {
+          break;
+        }
+        if (!codec_.decode_head(frames_.data(), head_len_, header_)) {
+          return;
+        }
+        frames_.consume(head_len_);
+        headed_ = true;
+      }
+      if (frames_.size() < header_.body_len) {
+        break;
+      }
+      bytes body;
+      if (!codec_.decode_body_in_place(header_, frames_.data(),
+                                       header_.body_len, body)) {
+        return;
+      }
+      frames_.consume(header_.body_len);
+      head_len_ = 0;
+      headed_ = false;
+      if (!on_(header_, body)) {
+        return;
+      }
+    }
+    size_t need = head_len_ == 0 ? size_t(frame_codec::HEAD_MIN)
+                  : headed_      ? size_t(header_.body_len)
+                                 : head_len_;
+    socket_.async_read_some(frames_.prepare(need),
+                            [this](std::error_code ec, std::size_t length) {
+                              if (!ec) {
+                                frames_.commit(length);
+                                read();
+                              }
+                            });
+  }
+
+  void write() {
+    boost::asio::async_write(socket_, boost::asio::buffer(out_.front()),
+                             [this](std::error_code ec, std::size_t) {
+                               if (ec) {
+                                 return;
+                               }
+                               out_.pop_front();
+                               if (!out_.empty()) {
+                                 write();
+                               }
+                             });
+  }
+
+  boost::asio::ip::tcp::socket socket_;
+  frame_codec codec_;
+  handler on_;
+  frame_reader frames_;
+  // the head being read, and whether it is decoded
+  size_t head_len_ = 0;
+  bool headed_ = false;
+  frame_header header_;
+  std::deque<bytes> out_;
+};
+
+} // namespace luke
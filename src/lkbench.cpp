@@ -0,0 +1,272 @@
+#include "common.hpp"
+#include "cpu.hpp"
+#include "crypto.hpp"
+#include "frame.hpp"
+#include "tunclient.hpp"
+#include "tunserver.hpp"
+#include <boost/program_options.hpp>
+#include <map>
+#if defined(__GNUC__) && defined(LUKE_X86)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+using namespace luke;
+namespace po = boost::program_options;
+
+/*
+Microbenchmarks of the frame pipeline: blowfish on its own, crypto
+encrypt/decrypt, zlib and frame building, over payload sizes from 64 bytes
+to 1 MB of compressible and random data. Prints a table and then the same
+results as JSON, so runs before and after a change can be compared.
+--selftest runs the crypto, frame and tunnel tests instead, which ctest
+does.
+*/
+namespace {
+
+struct result {
+  string name;
+  string payload;
+  size_t size;
+  double mb_per_s;
+  double cycles_per_byte; // 0 without a cycle counter
+};
+
+inline b8 cycles() {
+#ifdef LUKE_X86
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+double min_time = 0.2;
+
+// runs op(), which handles bytes_per_op bytes, for at least min_time
+template <typename Op>
+result measure(const string &name, const string &payload, size_t bytes_per_op,
+               Op op) {
+  using clock = chrono::steady_clock;
+  op(); // warm up, grow buffers
+  size_t ops = 0;
+  b8 c0 = cycles();
+  auto t0 = clock::now();
+  double secs = 0;
+  do {
+    for (int i = 0; i < 8; i++) {
+      op();
+    }
+    ops += 8;
+    secs = chrono::duration<double>(clock::now() - t0).count();
+  } while (secs < min_time);
+  b8 c1 = cycles();
+  double total = double(ops) * bytes_per_op;
+  return {name, payload, bytes_per_op, total / secs / 1e6,
+          c1 > c0 ? double(c1 - c0) / total : 0};
+}
+
+bytes make_payload(const string &kind, size_t size, mt19937 &rng) {
+  bytes dt(size);
+  if (kind == "random") {
+    for (auto &c : dt) {
+      c = (b1)rng();
+    }
+  } else {
+    static const string text =
+        "<tr><td class=\"name\">luketun</td><td>GET /index.html HTTP/1.1</td>"
+        "<td>200</td><td>text/html; charset=utf-8</td></tr>\n";
+    for (size_t i = 0; i < size; i++) {
+      dt[i] = (b1)text[(i + i / 997) % text.size()];
+    }
+  }
+  return dt;
+}
+
+b1 cipher_by_name(const string &name) {
+  static const map<string, b1> ids = {{"ecb", CIPHER_ECB},
+                                       {"ctr", CIPHER_CTR},
+                                       {"chacha", CIPHER_CHACHA20_POLY1305},
+                                       {"aes128", CIPHER_AES128_GCM},
+                                       {"aes256", CIPHER_AES256_GCM}};
+  auto it = ids.find(name);
+  if (it == ids.end()) {
+    throw runtime_error("unknown cipher " + name);
+  }
+  return it->second;
+}
+
+b1 codec_by_name(const string &name) {
+  if (name == "zlib") {
+    return CODEC_ZLIB;
+  }
+  if (name == "zstream") {
+    return CODEC_ZSTREAM;
+  }
+  if (name == "raw") {
+    return CODEC_RAW;
+  }
+  if (name == "lz4") {
+    return CODEC_LZ4;
+  }
+  if (name == "zchunks") {
+    return CODEC_ZCHUNKS;
+  }
+  throw runtime_error("unknown codec " + name);
+}
+
+void print_table(const vector<result> &rs) {
+  cout << left << setw(26) << "benchmark" << setw(12) << "payload"
+       << right << setw(10) << "bytes" << setw(12) << "MB/s" << setw(12)
+       << "cycles/B" << endl;
+  for (auto &r : rs) {
+    cout << left << setw(26) << r.name << setw(12) << r.payload << right
+         << setw(10) << r.size << setw(12) << fixed << setprecision(1)
+         << r.mb_per_s << setw(12) << setprecision(2) << r.cycles_per_byte
+         << endl;
+  }
+}
+
+void print_json(const vector<result> &rs, const string &cipher,
+                const string &codec) {
+  const cpu_features &cpu = cpu_features::get();
+  cout << "{\"cipher\": \"" << cipher << "\", \"codec\": \"" << codec
+       << "\", \"cpu\": {\"avx2\": "
+       << (cpu.avx2 ? "true" : "false")
+       << ", \"aesni\": " << (cpu.aesni ? "true" : "false")
+       << "}, \"results\": [";
+  for (size_t i = 0; i < rs.size(); i++) {
+    auto &r = rs[i];
+    cout << (i ? ",\n  " : "\n  ") << "{\"name\": \"" << r.name
+         << "\", \"payload\": \"" << r.payload << "\", \"bytes\": " << r.size
+         << ", \"mb_per_s\": " << fixed << setprecision(2) << r.mb_per_s
+         << ", \"cycles_per_byte\": " << r.cycles_per_byte << "}";
+  }
+  cout << "\n]}" << endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    string cipher_name, codec_name;
+    po::options_description desc("lkbench options");
+    desc.add_options()("help,h", "show this help")(
+        "cipher,c", po::value<string>(&cipher_name)->default_value("ecb"),
+        "body cipher: ecb, ctr, chacha, aes128, aes256")(
+        "codec,z", po::value<string>(&codec_name)->default_value("zlib"),
+        "body codec: zlib, zstream, raw, lz4, zchunks")(
+        "zthreads", po::value<size_t>()->default_value(0),
+        "more threads for zchunks, and for make_request of large frames")(
+        "min-time,t", po::value<double>(&min_time)->default_value(0.2),
+        "seconds per measurement")("json,j", "print only the JSON")(
+        "selftest", "run the crypto, frame and tunnel tests instead, exit 1 "
+                    "if any fails");
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+      cout << desc << endl;
+      return 0;
+    }
+    if (vm.count("selftest")) {
+      bool passed = crypto::test();
+      passed = frame_codec::test() && passed;
+      passed = frame_reader::test() && passed;
+      passed = tun_client::test() && passed;
+      passed = tun_server::test() && passed;
+      return passed ? 0 : 1;
+    }
+    b1 id = cipher_by_name(cipher_name);
+    b1 zc = codec_by_name(codec_name);
+
+    vector<result> rs;
+    mt19937 rng(2484);
+    const string key = "@@abort();";
+
+    // the raw block cipher
+    auto ctx = key_schedule::get(key);
+    bytes blocks = make_payload("random", 64 * 1024, rng);
+    rs.push_back(measure("Blowfish_Encrypt", "random", blocks.size(), [&]() {
+      for (size_t p = 0; p < blocks.size(); p += 8) {
+        b4 *w = reinterpret_cast<b4 *>(blocks.data() + p);
+        Blowfish_Encrypt(ctx.get(), w, w + 1);
+      }
+    }));
+    rs.push_back(
+        measure("Blowfish_Encrypt_Blocks", "random", blocks.size(), [&]() {
+          Blowfish_Encrypt_Blocks(ctx.get(), blocks.data(), blocks.size() / 8);
+        }));
+
+    std::unique_ptr<chunk_pool> zthreads;
+    if (vm["zthreads"].as<size_t>() > 0) {
+      zthreads.reset(new chunk_pool(vm["zthreads"].as<size_t>()));
+    }
+    crypto crp(key), stream_tx(key), stream_rx(key);
+    crp.set_zchunk_pool(zthreads.get());
+    codec_options opts;
+    opts.zchunk_pool = zthreads.get();
+    frame_codec codec(key, false, opts);
+    // the codec answers in the cipher and codec of the last request it
+    // decoded
+    if (id != CIPHER_ECB || zc != CODEC_ZLIB) {
+      frame_header hello;
+      hello.flags = id | (b4(zc) << 8);
+      hello.caps = frame_codec::LOCAL_CAPS;
+      b1 hd[frame_header::SIZE];
+      hello.encode(hd);
+      bytes enc(crypto::max_encrypted_size(sizeof(hd)));
+      enc.resize(crp.encrypt_into(hd, sizeof(hd), enc.data()));
+      frame_header h;
+      codec.decode_header(enc.data(), enc.size(), h);
+    }
+
+    for (const string kind : {"text", "random"}) {
+      for (size_t size = 64; size <= 1024 * 1024; size *= 4) {
+        bytes dt = make_payload(kind, size, rng);
+        bytes enc(crypto::max_encrypted_size(size));
+        bytes dec, z;
+        b8 nonce = 0;
+        size_t enc_len = 0;
+
+        rs.push_back(measure("encrypt", kind, size, [&]() {
+          enc_len = crp.encrypt_into(dt.data(), dt.size(), enc.data(), id, zc,
+                                     nonce);
+        }));
+        if (zc != CODEC_ZSTREAM) {
+          // decrypt the same frame over and over, it opens in place on a copy
+          rs.push_back(measure("decrypt", kind, size, [&]() {
+            crp.decrypt_into(enc.data(), enc_len, dec, id, zc, nonce);
+          }));
+        } else {
+          // a stream frame only decodes once, in order, so pair each with
+          // the encrypt that made it, on streams of their own
+          rs.push_back(measure("encrypt+decrypt", kind, size, [&]() {
+            enc_len = stream_tx.encrypt_into(dt.data(), dt.size(), enc.data(),
+                                             id, zc, nonce);
+            stream_rx.decrypt_into(enc.data(), enc_len, dec, id, zc, nonce);
+          }));
+        }
+        if (dec != dt) {
+          throw runtime_error("decrypt mismatch in " + kind);
+        }
+        rs.push_back(measure("zlib_compress", kind, size, [&]() {
+          crp.zlib_compress(dt.data(), dt.size(), z);
+        }));
+        rs.push_back(measure("make_request", kind, size, [&]() {
+          codec.encode(SOCKS_CONNECT, dt.data(), dt.size());
+        }));
+      }
+    }
+
+    if (!vm.count("json")) {
+      cout << "cipher " << cipher_name << ", codec " << codec_name << endl;
+      print_table(rs);
+      cout << endl;
+    }
+    print_json(rs, cipher_name, codec_name);
+  } catch (std::exception &e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -1,14 +1,100 @@
 #include "common.hpp"
 #include "crypto.hpp"
 #include "tunclient.hpp"
+#include "workers.hpp"
+#include <boost/program_options.hpp>
+#include <map>
 
 using namespace std;
+namespace po = boost::program_options;
 
 int main(int argc, char *argv[]) {
   try {
+    po::options_description desc("lkclient options");
+    desc.add_options()("help,h", "show this help")(
+        "workers,w", po::value<size_t>()->default_value(0),
+        "threads for zlib and crypto, 0 runs them on the io thread")(
+        "codec,z", po::value<string>()->default_value("zstream"),
+        "body codec once the server takes it: zlib, zstream, lz4")(
+        "adaptive,a", "move between lz4 and the zlib levels by CPU and link "
+                      "speed")(
+        "max-body,m", po::value<size_t>()->default_value(16),
+        "MB a received frame may decompress to")(
+        "zthreads,t", po::value<size_t>()->default_value(0),
+        "more threads to deflate large frames in chunks, 0 deflates them "
+        "whole")(
+        "mux,x", "carry every connection over one tunnel, the server must "
+                 "know streams")(
+        "warm,p", po::value<size_t>()->default_value(0),
+        "tunnels to keep connected for the next connections")(
+        "warm-idle", po::value<size_t>()->default_value(60),
+        "seconds a warm tunnel may sit idle before it is replaced")(
+        "coalesce,c", po::value<size_t>()->default_value(0),
+        "microseconds to gather small writes of a connection into one "
+        "frame, 0 sends each as it comes")(
+        "coalesce-bytes",
+        po::value<size_t>()->default_value(luke::LARGE_FRAME_SIZE),
+        "bytes gathered that make a frame without waiting")(
+        "frame-size,f", po::value<size_t>()->default_value(64),
+        "KB a frame carries at most, up to 1024 when the server takes large "
+        "frames; above 64 the server may answer in frames that large too");
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+      cout << desc << endl;
+      return 0;
+    }
+
+    static const map<string, luke::b1> codecs = {
+        {"zlib", luke::CODEC_ZLIB},
+        {"zstream", luke::CODEC_ZSTREAM},
+        {"lz4", luke::CODEC_LZ4}};
+    auto codec = codecs.find(vm["codec"].as<string>());
+    if (codec == codecs.end()) {
+      throw runtime_error("unknown codec " + vm["codec"].as<string>());
+    }
+    luke::codec_options opts;
+    opts.body_codec = codec->second;
+    opts.adaptive = vm.count("adaptive") > 0;
+    opts.max_body = vm["max-body"].as<size_t>() * 1024 * 1024;
+
     boost::asio::io_service io_context;
-    luke::tun_client s(io_context, 8181);
-    cout << "Tun client local server started on port 8181" << endl;
+    // after io_context, so the pools are joined before the sockets go away,
+    // and the workers that use the chunk threads before those
+    std::unique_ptr<luke::chunk_pool> zthreads;
+    if (vm["zthreads"].as<size_t>() > 0) {
+      zthreads.reset(new luke::chunk_pool(vm["zthreads"].as<size_t>()));
+    }
+    std::unique_ptr<luke::worker_pool> workers;
+    size_t nworkers = vm["workers"].as<size_t>();
+    if (nworkers > 0) {
+      workers.reset(new luke::worker_pool(nworkers));
+    }
+    opts.zchunk_pool = zthreads.get();
+
+    luke::tunnel_options tunnels;
+    tunnels.shared = vm.count("mux") > 0;
+    tunnels.warm = vm["warm"].as<size_t>();
+    tunnels.max_idle = std::chrono::seconds(vm["warm-idle"].as<size_t>());
+    tunnels.coalesce =
+        std::chrono::microseconds(vm["coalesce"].as<size_t>());
+    tunnels.coalesce_max = vm["coalesce-bytes"].as<size_t>();
+    tunnels.frame_size = vm["frame-size"].as<size_t>() * 1024;
+    // larger frames both ways, the server's answers too
+    opts.large_frames = vm["frame-size"].as<size_t>() > 64;
+    luke::tun_client s(io_context, 8181, workers.get(), opts, tunnels);
+    cout << "Tun client local server started on port 8181";
+    if (nworkers > 0) {
+      cout << " with " << nworkers << " workers";
+    }
+    if (tunnels.shared) {
+      cout << ", one tunnel for all connections";
+    }
+    if (tunnels.warm > 0) {
+      cout << ", " << tunnels.warm << " kept warm";
+    }
+    cout << endl;
     io_context.run();
   } catch (std::exception &e) {
     std::cerr << "Exception: " << e.what() << "\n";
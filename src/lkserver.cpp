@@ -1,15 +1,59 @@
 #include "common.hpp"
 #include "const.hpp"
 #include "tunserver.hpp"
+#include "workers.hpp"
+#include <boost/program_options.hpp>
 
 using namespace std;
+namespace po = boost::program_options;
 
 int main(int argc, char *argv[]) { 
   try {
+    po::options_description desc("lkserver options");
+    desc.add_options()("help,h", "show this help")(
+        "workers,w", po::value<size_t>()->default_value(0),
+        "threads for zlib and crypto, 0 runs them on the io thread")(
+        "adaptive,a", "move between lz4 and the zlib levels by CPU and link "
+                      "speed")(
+        "max-body,m", po::value<size_t>()->default_value(16),
+        "MB a received frame may decompress to")(
+        "large-frames,l", "take frames of up to 1 MB from clients that ask, "
+                          "max-body must be at least 1")(
+        "zthreads,t", po::value<size_t>()->default_value(0),
+        "more threads to deflate large frames in chunks, 0 deflates them "
+        "whole");
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+      cout << desc << endl;
+      return 0;
+    }
+
     boost::asio::io_service io_context;
+    // after io_context, so the pools are joined before the sockets go away,
+    // and the workers that use the chunk threads before those
+    std::unique_ptr<luke::chunk_pool> zthreads;
+    if (vm["zthreads"].as<size_t>() > 0) {
+      zthreads.reset(new luke::chunk_pool(vm["zthreads"].as<size_t>()));
+    }
+    std::unique_ptr<luke::worker_pool> workers;
+    size_t nworkers = vm["workers"].as<size_t>();
+    if (nworkers > 0) {
+      workers.reset(new luke::worker_pool(nworkers));
+    }
 
-    luke::tun_server s(io_context, 2484);
-    cout << "tun server started on port 2484" << endl;
+    luke::codec_options opts;
+    opts.adaptive = vm.count("adaptive") > 0;
+    opts.max_body = vm["max-body"].as<size_t>() * 1024 * 1024;
+    opts.large_frames = vm.count("large-frames") > 0;
+    opts.zchunk_pool = zthreads.get();
+    luke::tun_server s(io_context, 2484, workers.get(), opts);
+    cout << "tun server started on port 2484";
+    if (nworkers > 0) {
+      cout << " with " << nworkers << " workers";
+    }
+    cout << endl;
 
     io_context.run();
   } catch (std::exception &e) {
@@ -0,0 +1,224 @@
+/*
+ * The LZ4 block format, compatible with the reference lz4 blocks.
+ * Greedy matching over a 4096 entry hash table, skipping ahead faster the
+ * longer no match turns up, like LZ4_compress_fast. The decoder checks every
+ * length and offset against its buffers, the input comes off the network.
+ */
+#include "lz4.hpp"
+#include <cstring>
+
+namespace luke {
+
+enum {
+  MINMATCH = 4,
+  // the last match starts at least MFLIMIT bytes before the end and the
+  // last LASTLITERALS bytes are always literals
+  MFLIMIT = 12,
+  LASTLITERALS = 5,
+  MAX_DISTANCE = 65535,
+  SKIP_TRIGGER = 6
+};
+
+static inline b4 read32(const b1 *p) {
+  b4 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline b8 read64(const b1 *p) {
+  b8 v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline b4 lz4_hash(b4 seq) {
+  return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// bytes that match from p and ref on, stopping at limit
+static inline size_t match_length(const b1 *p, const b1 *ref,
+                                  const b1 *limit) {
+  const b1 *start = p;
+#if defined(__GNUC__)
+  while (p + 8 <= limit) {
+    b8 diff = read64(p) ^ read64(ref);
+    if (diff != 0) {
+      return p - start + (__builtin_ctzll(diff) >> 3);
+    }
+    p += 8;
+    ref += 8;
+  }
+#endif
+  while (p < limit && *p == *ref) {
+    p++;
+    ref++;
+  }
+  return p - start;
+}
+
+// a length of the token nibble and its 255 run bytes
+static inline b1 *put_length(b1 *op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (b1)len;
+  return op;
+}
+
+static inline bool get_length(const b1 *&ip, const b1 *iend, size_t &len) {
+  b1 s;
+  do {
+    if (ip >= iend) {
+      return false;
+    }
+    s = *ip++;
+    len += s;
+  } while (s == 255);
+  return true;
+}
+
+void LZ4_Init(LZ4_CTX *ctx) {
+  memset(ctx->table, 0, sizeof(ctx->table));
+  ctx->base = 1;
+}
+
+size_t LZ4_Compress_Block(LZ4_CTX *ctx, const b1 *src, size_t len, b1 *dst) {
+  // the table outlives a block, moving base forgets the old entries without
+  // clearing 16 KB for every small frame
+  if (len >= 0xFFFFFFFF - ctx->base) {
+    LZ4_Init(ctx);
+  }
+  const b4 base = ctx->base;
+  ctx->base += (b4)len + 1;
+
+  const b1 *ip = src;
+  const b1 *anchor = src;
+  const b1 *const iend = src + len;
+  b1 *op = dst;
+
+  if (len > MFLIMIT) {
+    const b1 *const mflimit = iend - MFLIMIT;
+    const b1 *const matchlimit = iend - LASTLITERALS;
+    size_t misses = 0;
+    while (ip < mflimit) {
+      b4 seq = read32(ip);
+      b4 &slot = ctx->table[lz4_hash(seq)];
+      b4 seen = slot;
+      slot = base + (b4)(ip - src);
+      const b1 *ref = seen >= base ? src + (seen - base) : src;
+      if (seen < base || ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+        ip += 1 + (misses++ >> SKIP_TRIGGER);
+        continue;
+      }
+      misses = 0;
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      size_t lit = ip - anchor;
+      size_t mlen =
+          match_length(ip + MINMATCH, ref + MINMATCH, matchlimit);
+      size_t offset = ip - ref;
+
+      b1 *token = op++;
+      *token = (b1)((lit >= 15 ? 15 : lit) << 4);
+      if (lit >= 15) {
+        op = put_length(op, lit);
+      }
+      memcpy(op, anchor, lit);
+      op += lit;
+      *op++ = (b1)offset;
+      *op++ = (b1)(offset >> 8);
+      *token |= (b1)(mlen >= 15 ? 15 : mlen);
+      if (mlen >= 15) {
+        op = put_length(op, mlen);
+      }
+
+      ip += MINMATCH + mlen;
+      anchor = ip;
+      // a position inside the match helps the next one along
+      if (ip < mflimit) {
+        ctx->table[lz4_hash(read32(ip - 2))] = base + (b4)(ip - 2 - src);
+      }
+    }
+  }
+
+  size_t lit = iend - anchor;
+  b1 *token = op++;
+  *token = (b1)((lit >= 15 ? 15 : lit) << 4);
+  if (lit >= 15) {
+    op = put_length(op, lit);
+  }
+  if (lit > 0) {
+    memcpy(op, anchor, lit);
+  }
+  op += lit;
+  return op - dst;
+}
+
+bool LZ4_Decompress_Block(const b1 *src, size_t len, b1 *dst, size_t dstLen) {
+  const b1 *ip = src;
+  const b1 *const iend = src + len;
+  b1 *op = dst;
+  b1 *const oend = dst + dstLen;
+
+  for (;;) {
+    if (ip >= iend) {
+      return false;
+    }
+    b1 token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15 && !get_length(ip, iend, lit)) {
+      return false;
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+      return false;
+    }
+    if (lit > 0) {
+      memcpy(op, ip, lit);
+    }
+    op += lit;
+    ip += lit;
+    if (ip == iend) {
+      // the last sequence is literals only
+      return op == oend;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return false;
+    }
+    size_t mlen = token & 15;
+    if (mlen == 15 && !get_length(ip, iend, mlen)) {
+      return false;
+    }
+    mlen += MINMATCH;
+    if (mlen > (size_t)(oend - op)) {
+      return false;
+    }
+    const b1 *ref = op - offset;
+    if (offset >= 8) {
+      // 8 byte steps never read bytes this copy hasn't written yet
+      b1 *end = op + mlen;
+      while (end - op >= 8) {
+        memcpy(op, ref, 8);
+        op += 8;
+        ref += 8;
+      }
+      while (op < end) {
+        *op++ = *ref++;
+      }
+    } else {
+      // an overlapping match repeats the last offset bytes
+      for (size_t i = 0; i < mlen; i++) {
+        *op++ = *ref++;
+      }
+    }
+  }
+}
+
+} // namespace luke
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace luke {
+
+#define LZ4_HASH_LOG 12
+
+typedef struct {
+  // base + position of the last place each hash was seen, entries below
+  // base are from an earlier block
+  b4 table[1 << LZ4_HASH_LOG];
+  b4 base;
+} LZ4_CTX;
+
+void LZ4_Init(LZ4_CTX *ctx);
+// worst case LZ4_Compress_Block output for len bytes
+constexpr size_t LZ4_Bound(size_t len) { return len + len / 255 + 16; }
+// one LZ4 block of src, dst must hold LZ4_Bound(len) bytes, returns the
+// bytes written
+size_t LZ4_Compress_Block(LZ4_CTX *ctx, const b1 *src, size_t len, b1 *dst);
+// false unless src is a well formed block of exactly dstLen bytes
+bool LZ4_Decompress_Block(const b1 *src, size_t len, b1 *dst, size_t dstLen);
+
+} // namespace luke
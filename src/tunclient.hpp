@@ -1,7 +1,8 @@
 #pragma once
 
 #include "common.hpp"
-#include "crypto.hpp"
+#include "frame.hpp"
+#include "workers.hpp"
 
 namespace luke {
 
@@ -9,53 +10,546 @@ using namespace boost;
 using namespace boost::asio::ip;
 using namespace std;
 
-class tun_client_session
-    : public std::enable_shared_from_this<tun_client_session> {
+class tun_client_session;
+
+// how a tun client gets to the server
+struct tunnel_options {
+  // one tunnel carries every session once the server said it has
+  // CAP_STREAMS, until then each session has a private one
+  bool shared = false;
+  // tunnels kept connected for the next sessions
+  size_t warm = 0;
+  // a warm tunnel idle this long is closed and replaced
+  std::chrono::seconds max_idle{60};
+  // how long a session gathers reads from its local connection into one
+  // frame, 0 sends every read as it comes
+  std::chrono::microseconds coalesce{0};
+  // a session sends what it gathered once it is this much, or a frame full
+  size_t coalesce_max = LARGE_FRAME_SIZE;
+  // the most a frame carries, up to LARGE_FRAME_SIZE when the server takes
+  // large frames and MAX_BUF_SIZE when it doesn't
+  size_t frame_size = MAX_BUF_SIZE;
+  // the port of the tun server on this host
+  unsigned short server_port = 2484;
+};
+
+/*
+A connection to the tun server and the frames on it. A shared tunnel carries
+the streams of many sessions, each opened and closed with a control frame, so a
+new browser connection costs no handshake and no crypto setup. A private one
+carries the frames of one session as stream 0, which is all a server without
+CAP_STREAMS knows. A tunnel that is to be shared is private to its first
+session until the server's first header says it has CAP_STREAMS, then it opens
+streams for more. Frames go out one at a time in the order they were sent. A
+received frame is deciphered where it was read and decoded a chunk at a time
+straight into the buffer of the session of its stream, and the next one is read
+once the session has taken the last chunk. A session takes each chunk at once,
+the tunnel waits only when a body finds the session's buffer full. A server
+with CAP_CREDITS sends a stream no more than the room its session granted, so
+one slow local connection doesn't hold up the others. Stream 0 of a shared
+tunnel counts from the STREAM_CREDIT it sends once the tunnel streams().
+*/
+class tun_client_tunnel
+    : public std::enable_shared_from_this<tun_client_tunnel> {
 public:
-  tun_client_session(asio::io_service &io_context, tcp::socket socket)
-      : io_context_(io_context), in_socket_(std::move(socket)),
-        out_socket_(io_context), resolver(io_context), crp("@@abort();") {}
+  tun_client_tunnel(asio::io_service &io_context, worker_pool *workers,
+                    const codec_options &opts, const tunnel_options &tunnels)
+      : socket_(io_context), resolver_(io_context),
+        codec_("@@abort();", true, opts), offload_(io_context, workers),
+        server_port_(tunnels.server_port),
+        frame_size_(std::min<size_t>(std::max<size_t>(tunnels.frame_size, 1),
+                                     LARGE_FRAME_SIZE)) {}
 
   void start() {
     auto self(shared_from_this());
     tunserver_host_ = "127.0.0.1";
-    tunserver_port_ = "2484";
-    resolver.async_resolve(
+    tunserver_port_ = std::to_string(server_port_);
+    resolver_.async_resolve(
         tcp::resolver::query(tunserver_host_, tunserver_port_),
         [this, self](const boost::system::error_code &ec,
                      tcp::resolver::iterator it) {
-          out_socket_.async_connect(
-              *it,
-              [this, self](const boost::system::error_code &ec) {
+          if (ec) {
+            log_err("Resolve tun server", ec);
+            fail();
+            return;
+          }
+          socket_.async_connect(
+              *it, [this, self](const boost::system::error_code &ec) {
                 if (ec) {
                   log_err("Failed to connect tun server" + tunserver_host_ +
                               ":" + tunserver_port_,
                           ec);
+                  fail();
                   return;
                 }
-                // log_info("Connected to ", remote_host_ + ":" + remote_port_);
-                // test get url
-                bytes data = bytes_from_string("https://www.baidu.com");
-                bytes req = make_request(GET_URL, data);
-                boost::asio::async_write(
-                    out_socket_, boost::asio::buffer(req, req.size()),
-                    [this, self](boost::system::error_code ec,
-                                 std::size_t length) {
-                      if (ec) {
-                        log_err("Write to out", ec);
-                        in_socket_.close();
-                        out_socket_.close();
-                        return;
-                      }
-                      do_read_from_out();
-                    });
+                connected_ = true;
+                send_next();
+                do_read_frame();
+              });
+        });
+  }
+
+  // false once the connection is gone, its sessions are closed then
+  bool alive() const { return !dead_; }
+
+  // close the connection and every stream on it
+  void shutdown() { fail(); }
+
+  // let open() add streams once the server has CAP_STREAMS
+  void share() { shared_ = true; }
+
+  // whether open() adds a stream rather than taking the tunnel
+  bool streams() const {
+    return shared_ && heard_ && (peer_caps_ & CAP_STREAMS);
+  }
+
+  /*
+  Whether the server keeps to the credit of stream and takes credits from
+  the start. open() adds streams only once the server was heard, so a
+  session never waits for a credit an old server won't send. Stream 0
+  counts only once a shared tunnel streams(), from count() on.
+  */
+  bool credits(b4 stream) const {
+    return stream != 0 && (peer_caps_ & CAP_CREDITS);
+  }
+
+  // the most a frame should carry, above MAX_BUF_SIZE only once the server
+  // said it takes large frames, and on a shared tunnel no more than a
+  // stream that counts credits may send at once
+  size_t max_frame() const {
+    size_t n = large_frames_ ? frame_size_
+                             : std::min<size_t>(frame_size_, MAX_BUF_SIZE);
+    return shared_ ? std::min<size_t>(n, STREAM_WINDOW) : n;
+  }
+
+  // a stream for session, after a STREAM_OPEN once the tunnel streams()
+  b4 open(const std::shared_ptr<tun_client_session> &session) {
+    b4 stream = 0;
+    if (streams()) {
+      // 0 is the stream of a private tunnel
+      stream = next_stream_++;
+      if (next_stream_ == 0) {
+        next_stream_ = 1;
+      }
+      send(stream, STREAM_OPEN, nullptr, 0, nullptr);
+    }
+    streams_[stream] = session;
+    return stream;
+  }
 
-                // start from socks5 session negotiation
-                // handle_negotiation();
+  // the session of stream is done, a private tunnel goes with it
+  void close(b4 stream) {
+    if (streams_.erase(stream) == 0) {
+      return;
+    }
+    if (stream != 0) {
+      send(stream, STREAM_CLOSE, nullptr, 0, nullptr);
+    } else if (!streams()) {
+      fail();
+    }
+  }
+
+  // a frame of len bytes from data, which must stay put until sent(ok)
+  void send(b4 stream, b4 cmd, const b1 *data, size_t len,
+            std::function<void(bool)> sent) {
+    if (dead_) {
+      if (sent) {
+        sent(false);
+      }
+      return;
+    }
+    queue_.push_back({stream, cmd, data, len, std::move(sent)});
+    send_next();
+  }
+
+private:
+  struct outgoing {
+    b4 stream;
+    b4 cmd;
+    const b1 *data;
+    size_t len;
+    std::function<void(bool)> sent;
+  };
+
+  /* request
+  crypto header length: 2 bytes
+  crypto header data
+    client ver b4: 20180517
+    cmd b4
+    crypto body data len b4
+  crypto real body data
+  see frame_header for the rest of the header
+  */
+  void send_next() {
+    if (writing_ || !connected_ || dead_ || queue_.empty()) {
+      return;
+    }
+    writing_ = true;
+    // the encode may run on a worker, which only ever sees sending_
+    sending_ = std::move(queue_.front());
+    queue_.pop_front();
+    auto self(shared_from_this());
+    offload_.run(
+        [this, self]() {
+          return codec_.encode(sending_.cmd, sending_.data, sending_.len,
+                               sending_.stream);
+        },
+        [this, self](const frame_codec::buffers &frame) {
+          auto start = std::chrono::steady_clock::now();
+          boost::asio::async_write(
+              socket_, frame,
+              [this, self, start](boost::system::error_code ec,
+                                  std::size_t length) {
+                writing_ = false;
+                auto sent = std::move(sending_.sent);
+                if (ec) {
+                  log_err("Write to out", ec);
+                  fail();
+                } else {
+                  codec_.written(socket_, length,
+                                 std::chrono::steady_clock::now() - start);
+                }
+                if (sent) {
+                  sent(!ec);
+                }
+                send_next();
               });
         });
   }
 
+  void do_read_frame() {
+    read_frame(frame_codec::HEAD_MIN, [this]() {
+      size_t head_len = frame_codec::head_size(frames_.data());
+      if (head_len == 0) {
+        log_err("[out]Bad header len");
+        fail();
+        return;
+      }
+      read_frame(head_len, [this, head_len]() { do_decode_head(head_len); });
+    });
+  }
+
+  void do_decode_head(size_t head_len) {
+    auto self(shared_from_this());
+    // decrpyt header
+    offload_.run(
+        [this, self, head_len]() {
+          return codec_.decode_head(frames_.data(), head_len, header_);
+        },
+        [this, self, head_len](bool ok) {
+          if (!ok) {
+            log_err("[out]Bad header");
+            fail();
+            return;
+          }
+          frames_.consume(head_len);
+          bool streamed = streams();
+          heard_ = true;
+          peer_caps_ = header_.caps;
+          large_frames_ = (peer_caps_ & CAP_LARGE_FRAMES) != 0;
+          auto first = streams_.find(0);
+          if (!streamed && streams() && (peer_caps_ & CAP_CREDITS) &&
+              first != streams_.end()) {
+            // the first session shares the tunnel now, so it counts too
+            count(first->second);
+          }
+          read_frame(header_.body_len, [this]() { do_open_body(); });
+        });
+  }
+
+  void do_open_body() {
+    auto self(shared_from_this());
+    b4 body_len = header_.body_len;
+    // decrpyt body, then send it to its session a chunk at a time
+    offload_.run(
+        [this, self, body_len]() {
+          return codec_.open_body(header_, frames_.data(), body_len);
+        },
+        [this, self](bool ok) {
+          if (!ok) {
+            log_err("[out]Bad body");
+            fail();
+            return;
+          }
+          // the body stays in frames_ until its last chunk is out
+          auto it = streams_.find(header_.stream);
+          receiver_ = it != streams_.end() ? it->second : nullptr;
+          if (header_.cmd == STREAM_CLOSE && it != streams_.end()) {
+            streams_.erase(it);
+            // after what it was sent before
+            finished(receiver_);
+            receiver_ = nullptr;
+          }
+          do_relay_chunk();
+        });
+  }
+
+  // the next chunk of the body into the buffer of the receiver, a body
+  // nobody takes is still decoded all through, a stream codec needs all of it
+  void do_relay_chunk() {
+    auto self(shared_from_this());
+    b1 *dst;
+    size_t cap;
+    if (receiver_ && header_.cmd != STREAM_CREDIT) {
+      dst = room(receiver_, cap);
+      if (cap == 0) {
+        // the tunnel waits until the session wrote some of it
+        deliver(receiver_, 0, [this, self]() { do_relay_chunk(); });
+        return;
+      }
+    } else {
+      scratch_.resize(frame_codec::BODY_CHUNK);
+      dst = scratch_.data();
+      cap = scratch_.size();
+    }
+    cap = std::min<size_t>(cap, frame_codec::BODY_CHUNK);
+    offload_.run(
+        [this, self, dst, cap]() {
+          return codec_.next_chunk(dst, cap, chunk_len_, body_done_);
+        },
+        [this, self](bool ok) {
+          if (!ok) {
+            log_err("[out]Bad body");
+            fail();
+            return;
+          }
+          if (receiver_ && header_.cmd == STREAM_CREDIT) {
+            if (chunk_len_ >= 4) {
+              credited(receiver_, get_b4(scratch_.data()));
+            }
+            chunk_written();
+          } else if (receiver_ && chunk_len_ > 0) {
+            deliver(receiver_, chunk_len_, [this, self]() { chunk_written(); });
+          } else {
+            chunk_written();
+          }
+        });
+  }
+
+  void chunk_written() {
+    if (dead_) {
+      return;
+    }
+    if (body_done_) {
+      receiver_ = nullptr;
+      frames_.consume(header_.body_len);
+      do_read_frame();
+    } else {
+      do_relay_chunk();
+    }
+  }
+
+  // then() once frames_ holds n bytes, reading only if it doesn't yet
+  template <typename Then> void read_frame(size_t n, Then then) {
+    if (frames_.size() >= n) {
+      then();
+      return;
+    }
+    auto self(shared_from_this());
+    socket_.async_read_some(
+        frames_.prepare(n),
+        [this, self, n, then](std::error_code ec, std::size_t length) {
+          if (ec) {
+            if (!dead_) {
+              log_err("[out]Read frame", ec);
+              fail();
+            }
+            return;
+          }
+          frames_.commit(length);
+          read_frame(n, then);
+        });
+  }
+
+  // the connection is gone, and with it every stream on it
+  void fail() {
+    if (dead_) {
+      return;
+    }
+    dead_ = true;
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    auto streams = std::move(streams_);
+    streams_.clear();
+    for (auto &s : streams) {
+      closed(s.second);
+    }
+    auto queue = std::move(queue_);
+    queue_.clear();
+    for (auto &o : queue) {
+      if (o.sent) {
+        o.sent(false);
+      }
+    }
+  }
+
+  // defined after tun_client_session
+  b1 *room(const std::shared_ptr<tun_client_session> &session, size_t &n);
+  void deliver(const std::shared_ptr<tun_client_session> &session, size_t n,
+               std::function<void()> written);
+  void closed(const std::shared_ptr<tun_client_session> &session);
+  void finished(const std::shared_ptr<tun_client_session> &session);
+  void credited(const std::shared_ptr<tun_client_session> &session,
+                size_t n);
+  void count(const std::shared_ptr<tun_client_session> &session);
+
+  tcp::socket socket_;
+  tcp::resolver resolver_;
+  string tunserver_host_;
+  string tunserver_port_;
+  frame_codec codec_;
+  session_offload offload_;
+  unsigned short server_port_;
+  bool shared_ = false;
+  size_t frame_size_;
+  // the caps of the server's last header, once there was one
+  bool heard_ = false;
+  b4 peer_caps_ = 0;
+  bool large_frames_ = false;
+  bool connected_ = false;
+  bool dead_ = false;
+  b4 next_stream_ = 1;
+  // a session lives while its stream is open, even when it reads nothing
+  std::unordered_map<b4, std::shared_ptr<tun_client_session>> streams_;
+  // frames waiting for the one being written
+  std::deque<outgoing> queue_;
+  outgoing sending_;
+  bool writing_ = false;
+  frame_reader frames_;
+  // the header being handled, written by decode_head
+  frame_header header_;
+  // the session the frame being relayed goes to, if it is still there
+  std::shared_ptr<tun_client_session> receiver_;
+  // the length of the last chunk, and whether it was the last of the body
+  size_t chunk_len_ = 0;
+  bool body_done_ = false;
+  // chunks no session takes, and STREAM_CREDIT bodies
+  bytes scratch_;
+};
+
+class tun_client_session
+    : public std::enable_shared_from_this<tun_client_session> {
+public:
+  // what waits for in, a window and a byte: a body that fills the window
+  // of a stream that counts credits leaves the decoder room to say it ended
+  enum : size_t { OUTQ_SIZE = STREAM_WINDOW + 1 };
+
+  tun_client_session(asio::io_service &io_context, tcp::socket socket,
+                     std::shared_ptr<tun_client_tunnel> tunnel,
+                     const tunnel_options &tunnels)
+      : io_context_(io_context), in_socket_(std::move(socket)),
+        tunnel_(std::move(tunnel)), coalesce_(tunnels.coalesce),
+        coalesce_max_(std::max<size_t>(tunnels.coalesce_max, 1)),
+        coalesce_timer_(io_context) {}
+
+  void start() {
+    auto self(shared_from_this());
+    stream_ = tunnel_->open(self);
+    counted_ = tunnel_->credits(stream_);
+    // test get url
+    url_ = bytes_from_string("https://www.baidu.com");
+    tunnel_->send(stream_, GET_URL, url_.data(), url_.size(),
+                  [this, self](bool ok) {
+                    if (!ok) {
+                      close();
+                    }
+                  });
+    spend(url_.size());
+
+    // start from socks5 session negotiation
+    // handle_negotiation();
+    // until then what in sends is relayed as it is
+    do_read_from_in();
+  }
+
+  // where the next n bytes from out to in go, n is 0 while all of
+  // OUTQ_SIZE waits to be written
+  b1 *room(size_t &n) {
+    if (!outq_) {
+      outq_.reset(new b1[OUTQ_SIZE]);
+    }
+    if (queued_ == 0) {
+      // not before, the chunk of the last room() may still be decoding
+      head_ = 0;
+    }
+    size_t tail = (head_ + queued_) % OUTQ_SIZE;
+    n = std::min<size_t>(OUTQ_SIZE - queued_, OUTQ_SIZE - tail);
+    return outq_.get() + tail;
+  }
+
+  // n bytes were put where room() said, taken() at once. A full buffer only
+  // holds up the tunnel when room() left no place for the rest of a body,
+  // then n is 0 and taken() waits until a write to in made some.
+  void deliver(size_t n, std::function<void()> taken) {
+    if (!in_socket_.is_open()) {
+      // in is gone, the tunnel goes on without it
+      drop();
+      taken();
+      return;
+    }
+    queued_ += n;
+    do_write_to_in();
+    if (n == 0 && queued_ == OUTQ_SIZE) {
+      blocked_ = std::move(taken);
+    } else {
+      taken();
+    }
+  }
+
+  // the tunnel or the server closed the stream
+  void closed() {
+    boost::system::error_code ignored;
+    in_socket_.close(ignored);
+    coalesce_timer_.cancel(ignored);
+  }
+
+  // the server closed the stream, closed() once what it sent is written
+  void finished() {
+    finished_ = true;
+    if (!writing_) {
+      closed();
+    }
+  }
+
+  // the server took n more bytes of the stream
+  void credited(size_t n) {
+    if (syncing_) {
+      // the server counts what it sends from its answer to count() on,
+      // and gets the room that is left
+      syncing_ = false;
+      ungranted_ = STREAM_WINDOW - std::min<size_t>(queued_, STREAM_WINDOW);
+      grant(0);
+    }
+    credit_ += n;
+    if (starved_) {
+      starved_ = false;
+      do_read_from_in();
+    }
+  }
+
+  /*
+  The tunnel of stream 0 streams() now, and what goes on it counts credits
+  from the STREAM_CREDIT of nothing this sends. What was read but is still
+  to go out counts, and a read under way is at most what is left of a
+  window. The server answers with a STREAM_CREDIT of its own, what it sends
+  after that counts, credited() grants it what the buffer has room for.
+  */
+  void count() {
+    counted_ = true;
+    syncing_ = true;
+    credit_ = STREAM_WINDOW - pending_.size();
+    put_b4(grant_, 0);
+    granting_ = true;
+    auto self(shared_from_this());
+    tunnel_->send(stream_, STREAM_CREDIT, grant_, sizeof(grant_),
+                  [this, self](bool ok) {
+                    granting_ = false;
+                    if (ok) {
+                      grant(0);
+                    }
+                  });
+  }
+
 private:
   void handle_negotiation() {
     auto self(shared_from_this());
@@ -104,8 +598,8 @@ private:
                             }
                             // relay start
                             // socks5 client <->[in]tunclient[out]<->
-                            // [in]tunserver[out] <-> real site
-                            do_read_from_out();
+                            // [in]tunserver[out] <-> real site, the
+                            // tunnel reads from out
                             do_read_from_in();
                           });
                     });
@@ -113,159 +607,610 @@ private:
         });
   }
 
-  void do_read_from_out() {
-    auto self(shared_from_this());
-    out_data_.resize(2);
-    asio::async_read(
-        out_socket_, asio::buffer(out_data_, 2),
-        [this, self](std::error_code ec, std::size_t length) {
-          if (ec || length != 2) {
-            log_err("[out]Read header len", ec);
-            return;
-          }
-          b2 header_len = get_b2(out_data_, 0);
-          out_data_.resize(header_len);
-          asio::async_read(
-              out_socket_, asio::buffer(out_data_, header_len),
-              [this, self, header_len](std::error_code ec, std::size_t length) {
-                if (ec || length != header_len) {
-                  log_err("[out]Read header data", ec);
-                  return;
-                }
-                // decrpyt header
-                bytes header = crp.decrypt(out_data_);
-                int pos = 0;
-                b4 ver = get_b4(header, pos);
-                pos += 4;
-                b2 cmd = get_b4(header, pos);
-                pos += 4;
-                b4 body_len = get_b4(header, pos);
-                pos += 4;
-                out_data_.resize(body_len);
-                asio::async_read(out_socket_, asio::buffer(out_data_, body_len),
-                                 [this, self, body_len](std::error_code ec,
-                                                        std::size_t length) {
-                                   if (ec || length != body_len) {
-                                     log_err("[out]Read body data", ec);
-                                     return;
-                                   }
-                                   // decrpyt body
-                                   bytes body = crp.decrypt(out_data_);
-                                   //  dump_bytes("[out]body", body);
-                                   // cout << string_from_bytes(body);
-                                   // now we have body from out, send it to in
-                                   do_write_to_in(body, body.size());
-                                 });
-              });
-        });
-  }
-
   void do_read_from_in() {
+    if (finished_) {
+      return;
+    }
     auto self(shared_from_this());
-    in_data_.resize(MAX_BUF_SIZE);
+    // a gathering session reads no more than fits its next frame, and none
+    // reads more than the server still takes
+    size_t n = coalesce_.count() > 0 ? coalesce_limit() - pending_.size()
+                                     : tunnel_->max_frame();
+    if (counted_) {
+      if (credit_ == 0) {
+        starved_ = true;
+        return;
+      }
+      n = std::min(n, credit_);
+    }
+    in_data_.resize(n);
+    reading_ = true;
     in_socket_.async_receive(
-        boost::asio::buffer(in_data_, MAX_BUF_SIZE),
+        boost::asio::buffer(in_data_, n),
         [this, self](boost::system::error_code ec, std::size_t length) {
+          reading_ = false;
+          if (finished_) {
+            return;
+          }
           if (ec) {
             log_err("Read from in", ec);
-            in_socket_.close();
-            out_socket_.close();
+            if (coalesce_.count() > 0) {
+              // what was gathered still goes out first
+              closing_ = true;
+              flush();
+              if (!sending_) {
+                close();
+              }
+              return;
+            }
+            close();
             return;
           }
           // dump_bytes("do_read_from_in", in_data_);
           // we got data from in, relay it to out
-          do_write_to_out(in_data_, length);
+          spend(length);
+          if (coalesce_.count() > 0) {
+            gather(length);
+          } else {
+            do_write_to_out(in_data_, length);
+          }
         });
   }
 
-  void do_write_to_in(bytes &dt, std::size_t length) {
+  /*
+  Chatty connections send many small writes, each of which would be a frame
+  of its own with its own compression and header. Reads go into pending_
+  instead, which becomes one frame when it reaches coalesce_limit() or
+  coalesce_ after its first byte, or when the frame before it is out.
+  Reading stops while pending_ is full and a frame is still going out.
+  */
+  void gather(size_t length) {
+    bool first = pending_.empty();
+    pending_.insert(pending_.end(), in_data_.begin(),
+                    in_data_.begin() + length);
+    if (pending_.size() >= coalesce_limit()) {
+      flush();
+    } else if (first && !sending_) {
+      auto self(shared_from_this());
+      coalesce_timer_.expires_from_now(coalesce_);
+      coalesce_timer_.async_wait(
+          [this, self](const boost::system::error_code &ec) {
+            if (!ec) {
+              flush();
+            }
+          });
+    }
+    if (pending_.size() < coalesce_limit()) {
+      do_read_from_in();
+    }
+  }
+
+  size_t coalesce_limit() const {
+    return std::min(coalesce_max_, tunnel_->max_frame());
+  }
+
+  // pending_ out as one frame, unless one is out already
+  void flush() {
+    if (sending_ || pending_.empty()) {
+      return;
+    }
+    coalesce_timer_.cancel();
+    std::swap(pending_, flushing_);
+    pending_.clear();
+    sending_ = true;
     auto self(shared_from_this());
-    boost::asio::async_write(
-        in_socket_, boost::asio::buffer(dt, length),
-        [this, self](boost::system::error_code ec, std::size_t length) {
-          if (ec) {
-            log_err("Write to in", ec);
-            in_socket_.close();
-            out_socket_.close();
-            return;
-          }
-          do_read_from_out();
-        });
+    tunnel_->send(stream_, SOCKS_CONNECT, flushing_.data(), flushing_.size(),
+                  [this, self](bool ok) {
+                    sending_ = false;
+                    if (!ok) {
+                      close();
+                      return;
+                    }
+                    // what came in meanwhile has waited long enough
+                    flush();
+                    if (closing_) {
+                      if (!sending_) {
+                        close();
+                      }
+                    } else if (!reading_) {
+                      // reading stopped on a full pending_
+                      do_read_from_in();
+                    }
+                  });
   }
 
   void do_write_to_out(bytes &dt, std::size_t length) {
     auto self(shared_from_this());
-    bytes relaypkg = make_request(SOCKS_CONNECT, dt);
+    tunnel_->send(stream_, SOCKS_CONNECT, dt.data(), length,
+                  [this, self](bool ok) {
+                    if (!ok) {
+                      close();
+                      return;
+                    }
+                    do_read_from_in();
+                  });
+  }
+
+  // length more bytes of the stream went to the server
+  void spend(size_t length) {
+    if (counted_) {
+      credit_ -= std::min(credit_, length);
+    }
+  }
+
+  // what outq_ holds to in, up to its end and then from its start
+  void do_write_to_in() {
+    if (writing_ || queued_ == 0) {
+      return;
+    }
+    writing_ = true;
+    size_t n = std::min<size_t>(queued_, OUTQ_SIZE - head_);
+    auto self(shared_from_this());
     boost::asio::async_write(
-        out_socket_, boost::asio::buffer(relaypkg, relaypkg.size()),
-        [this, self](boost::system::error_code ec, std::size_t length) {
+        in_socket_, boost::asio::buffer(outq_.get() + head_, n),
+        [this, self, n](boost::system::error_code ec, std::size_t) {
+          writing_ = false;
           if (ec) {
-            log_err("Write to out", ec);
-            in_socket_.close();
-            out_socket_.close();
-            return;
+            log_err("Write to in", ec);
+            // the tunnel goes on without what is left
+            drop();
+            close();
+          } else {
+            queued_ -= n;
+            head_ = (head_ + n) % OUTQ_SIZE;
+            grant(n);
+            do_write_to_in();
+          }
+          if (finished_ && !writing_) {
+            closed();
+          }
+          if (blocked_ && queued_ < OUTQ_SIZE) {
+            auto taken = std::move(blocked_);
+            blocked_ = nullptr;
+            taken();
           }
-          do_read_from_in();
         });
   }
 
-  /* request
-  crypto header length: 2 bytes
-  crypto header data
-    client ver b4: 20180517
-    cmd b4
-    crypto body data len b4
-  crypto real body data
-  */
-  const bytes make_request(b4 cmd, const bytes &body_data) {
-    bytes ret;
-    bytes encrpyt_body = crp.encrypt(body_data);
-    bytes header_data;
-    push_b4(header_data, VER);
-    push_b4(header_data, cmd);
-    push_b4(header_data, (b4)encrpyt_body.size()); // crypto body size
-    bytes encrpyt_header = crp.encrypt(header_data);
-    push_b2(ret, (b2)encrpyt_header.size()); // header length
-    push_bytes(ret, encrpyt_header);
-    push_bytes(ret, encrpyt_body);
-    return ret;
+  // what waits for in won't be written
+  void drop() {
+    queued_ = 0;
+    head_ = 0;
+  }
+
+  // n more bytes from the server are written, granted back with a
+  // STREAM_CREDIT once that is half a window
+  void grant(size_t n) {
+    ungranted_ += n;
+    if (granting_ || finished_ || !counted_ || syncing_ ||
+        ungranted_ < STREAM_WINDOW / 2) {
+      return;
+    }
+    put_b4(grant_, (b4)ungranted_);
+    ungranted_ = 0;
+    granting_ = true;
+    auto self(shared_from_this());
+    tunnel_->send(stream_, STREAM_CREDIT, grant_, sizeof(grant_),
+                  [this, self](bool ok) {
+                    granting_ = false;
+                    if (ok) {
+                      grant(0);
+                    }
+                  });
+  }
+
+  void close() {
+    tunnel_->close(stream_);
+    closed();
   }
 
   asio::io_service &io_context_;
   tcp::socket in_socket_;
-  tcp::socket out_socket_;
-  tcp::resolver resolver;
+  std::shared_ptr<tun_client_tunnel> tunnel_;
+  b4 stream_ = 0;
+  // the body of the GET_URL test, kept until it is sent
+  bytes url_;
   bytes in_data_;
-  bytes out_data_;
-  string tunserver_host_;
-  string tunserver_port_;
-  luke::crypto crp;
+  std::chrono::microseconds coalesce_;
+  size_t coalesce_max_;
+  asio::steady_timer coalesce_timer_;
+  // gathered reads, and the frame of them going out
+  bytes pending_;
+  bytes flushing_;
+  bool sending_ = false;
+  bool reading_ = false;
+  // in is done, close once pending_ is out
+  bool closing_ = false;
+  // the server keeps to credit_ and takes our grants, on stream 0 since
+  // count(), which waits for the server's answer before it grants
+  bool counted_ = false;
+  bool syncing_ = false;
+  // what the server still takes while counted_
+  size_t credit_ = STREAM_WINDOW;
+  // reading waits for a credit
+  bool starved_ = false;
+  // OUTQ_SIZE bytes from the server, queued_ of them from head_ on
+  // waiting for in, made on the first chunk
+  std::unique_ptr<b1[]> outq_;
+  size_t head_ = 0;
+  size_t queued_ = 0;
+  bool writing_ = false;
+  // the tunnel waits for room in outq_
+  std::function<void()> blocked_;
+  // bytes written to in that the server hasn't been granted yet, and the
+  // body of the STREAM_CREDIT going out
+  size_t ungranted_ = 0;
+  b1 grant_[4];
+  bool granting_ = false;
+  // the server closed the stream
+  bool finished_ = false;
 }; // namespace luke
 
+inline b1 *
+tun_client_tunnel::room(const std::shared_ptr<tun_client_session> &session,
+                        size_t &n) {
+  return session->room(n);
+}
+
+inline void
+tun_client_tunnel::deliver(const std::shared_ptr<tun_client_session> &session,
+                           size_t n, std::function<void()> written) {
+  session->deliver(n, std::move(written));
+}
+
+inline void
+tun_client_tunnel::closed(const std::shared_ptr<tun_client_session> &session) {
+  if (session) {
+    session->closed();
+  }
+}
+
+inline void tun_client_tunnel::finished(
+    const std::shared_ptr<tun_client_session> &session) {
+  session->finished();
+}
+
+inline void
+tun_client_tunnel::credited(const std::shared_ptr<tun_client_session> &session,
+                            size_t n) {
+  session->credited(n);
+}
+
+inline void
+tun_client_tunnel::count(const std::shared_ptr<tun_client_session> &session) {
+  session->count();
+}
+
+/*
+Tunnels connected ahead of the sessions that will use them, so a new
+connection doesn't wait a round trip for its tunnel. Taking one starts its
+replacement. Ones idle longer than max_idle, which the server or a NAT on
+the way may have forgotten, are closed and replaced, as are ones that died.
+*/
+class tunnel_pool {
+public:
+  typedef std::function<std::shared_ptr<tun_client_tunnel>()> maker;
+
+  tunnel_pool(asio::io_service &io_context, size_t size,
+              std::chrono::steady_clock::duration max_idle, maker make)
+      : timer_(io_context), size_(size), max_idle_(max_idle),
+        make_(std::move(make)) {
+    refill();
+    expire();
+  }
+
+  // the oldest live tunnel, or a new one when none is left
+  std::shared_ptr<tun_client_tunnel> take() {
+    std::shared_ptr<tun_client_tunnel> t;
+    while (!t && !idle_.empty()) {
+      if (idle_.front().tunnel->alive()) {
+        t = idle_.front().tunnel;
+      }
+      idle_.pop_front();
+    }
+    refill();
+    return t ? t : make_();
+  }
+
+private:
+  struct idle {
+    std::shared_ptr<tun_client_tunnel> tunnel;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  void refill() {
+    while (idle_.size() < size_) {
+      idle_.push_back({make_(), std::chrono::steady_clock::now()});
+    }
+  }
+
+  // once a second, drop the dead and the expired
+  void expire() {
+    timer_.expires_from_now(std::chrono::seconds(1));
+    timer_.async_wait([this](const boost::system::error_code &ec) {
+      if (ec) {
+        return;
+      }
+      auto now = std::chrono::steady_clock::now();
+      idle_.erase(std::remove_if(idle_.begin(), idle_.end(),
+                                 [this, now](idle &i) {
+                                   if (i.tunnel->alive() &&
+                                       now - i.since < max_idle_) {
+                                     return false;
+                                   }
+                                   i.tunnel->shutdown();
+                                   return true;
+                                 }),
+                  idle_.end());
+      refill();
+      expire();
+    });
+  }
+
+  asio::steady_timer timer_;
+  size_t size_;
+  std::chrono::steady_clock::duration max_idle_;
+  maker make_;
+  std::deque<idle> idle_;
+};
+
 class tun_client {
 public:
-  tun_client(asio::io_service &io_context, short port)
+  // workers may be nullptr, then sessions do their crypto inline
+  tun_client(asio::io_service &io_context, short port,
+             worker_pool *workers = nullptr,
+             const codec_options &opts = codec_options(),
+             const tunnel_options &tunnels = tunnel_options())
       : io_context_(io_context),
         acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-        in_socket_(io_context) {
+        in_socket_(io_context), workers_(workers), opts_(opts),
+        tunnels_(tunnels), shared_(tunnels.shared) {
+    if (tunnels.warm > 0) {
+      warm_.reset(new tunnel_pool(io_context, tunnels.warm,
+                                  tunnels.max_idle,
+                                  [this]() { return new_tunnel(); }));
+    }
     do_accept();
   }
 
+  // the local port, which port 0 leaves to the system
+  unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+  /*
+  Prints a line for each test, true if all of them passed. A server that
+  never answers, as an old one may not, still takes more than a window of
+  upload on stream 0, on a private tunnel and on one that is to be shared.
+  With a server that counts credits, sessions keep to them on stream 0 and
+  on the streams after it, and ones that never read hold up no other.
+  */
+  static bool test() {
+    enum : size_t { UPLOAD = 4 * STREAM_WINDOW };
+    bool passed = true;
+    for (bool shared : {false, true}) {
+      asio::io_service io;
+      tcp::acceptor server(io, tcp::endpoint(address_v4::loopback(), 0));
+      tunnel_options tunnels;
+      tunnels.shared = shared;
+      tunnels.server_port = server.local_endpoint().port();
+      tun_client client(io, 0, nullptr, codec_options(), tunnels);
+
+      // the server only reads, and counts what the session relays
+      test_peer peer(io, false);
+      size_t got = 0;
+      server.async_accept(peer.socket(), [&](std::error_code ec) {
+        if (ec) {
+          return;
+        }
+        peer.start([&](const frame_header &h, const bytes &body) {
+          if (h.cmd == SOCKS_CONNECT) {
+            got += body.size();
+          }
+          if (got < UPLOAD) {
+            return true;
+          }
+          io.stop();
+          return false;
+        });
+      });
+
+      bytes upload(UPLOAD, 'u');
+      tcp::socket local(io);
+      local.connect(tcp::endpoint(address_v4::loopback(), client.port()));
+      asio::async_write(local, asio::buffer(upload),
+                        [](std::error_code, std::size_t) {});
+      run_for(io, std::chrono::seconds(10));
+      passed = passed && got == UPLOAD;
+    }
+    if (passed) {
+      printf("Test 20 OK.\n");
+    } else {
+      printf("Test 20 failed.\n");
+    }
+
+    /*
+    A shared tunnel to a server with CAP_STREAMS and CAP_CREDITS. The first
+    session stays on stream 0 and a later one is stuck, neither reads, and
+    the server sends them all the credit they grant. Another uploads two
+    windows, which the server grants a window at a time once the session
+    has stopped for want of credit. Once the stuck ones grant no more, a
+    frame to the uploading one still gets through.
+    */
+    asio::io_service io;
+    tcp::acceptor server(io, tcp::endpoint(address_v4::loopback(), 0));
+    tunnel_options tunnels;
+    tunnels.shared = true;
+    tunnels.server_port = server.local_endpoint().port();
+    tun_client client(io, 0, nullptr, codec_options(), tunnels);
+    tcp::endpoint local(address_v4::loopback(), client.port());
+    tcp::socket first(io), up(io), stuck(io);
+    b4 up_stream = 0, stuck_stream = 0;
+
+    test_peer peer(io, false);
+    // what the server may still send on a stream and what the session may
+    // still send it, once they count
+    std::map<b4, size_t> credit, window;
+    bool synced = false, kept = true;
+    bytes fill(MAX_BUF_SIZE, 'd'), upload(2 * STREAM_WINDOW, 'u');
+    size_t uploaded = 0;
+    b1 grant[4];
+    // all the credit of the stuck ones goes out
+    auto pump = [&]() {
+      for (auto &c : credit) {
+        while (c.second > 0) {
+          size_t n = std::min(c.second, fill.size());
+          peer.send(OK, c.first, fill.data(), n);
+          c.second -= n;
+        }
+      }
+    };
+    // once no credit came for a while the stuck ones are full
+    asio::steady_timer quiet(io);
+    std::function<void()> settle = [&]() {
+      quiet.expires_from_now(std::chrono::milliseconds(200));
+      quiet.async_wait([&](const boost::system::error_code &ec) {
+        if (ec) {
+          return;
+        }
+        if (stuck_stream != 0 && uploaded == upload.size()) {
+          peer.send(OK, up_stream, fill.data(), 1);
+        } else {
+          settle();
+        }
+      });
+    };
+    b1 probe;
+    server.async_accept(peer.socket(), [&](std::error_code ec) {
+      if (ec) {
+        return;
+      }
+      peer.start([&](const frame_header &h, const bytes &body) {
+        b4 s = h.stream;
+        if (h.cmd == STREAM_OPEN && up_stream == 0) {
+          up_stream = s;
+          window[s] = STREAM_WINDOW;
+          asio::async_write(up, asio::buffer(upload),
+                            [](std::error_code, std::size_t) {});
+          asio::async_read(up, asio::buffer(&probe, 1),
+                           [&](std::error_code ec, std::size_t) {
+                             if (!ec) {
+                               io.stop();
+                             }
+                           });
+          stuck.async_connect(local, [](std::error_code) {});
+        } else if (h.cmd == STREAM_OPEN) {
+          stuck_stream = s;
+          credit[s] = STREAM_WINDOW;
+          window[s] = STREAM_WINDOW;
+          pump();
+          settle();
+        } else if (h.cmd == STREAM_CREDIT && s == 0 && !synced) {
+          // stream 0 counts from here, what the server sends from its
+          // answer on
+          synced = true;
+          credit[0] = 0;
+          window[0] = STREAM_WINDOW;
+          put_b4(grant, 0);
+          peer.send(STREAM_CREDIT, 0, grant, sizeof(grant));
+          // the tunnel streams() now
+          up.async_connect(local, [](std::error_code) {});
+        } else if (h.cmd == STREAM_CREDIT) {
+          credit[s] += body.size() >= 4 ? get_b4(body.data()) : 0;
+          kept = kept && credit[s] <= STREAM_WINDOW;
+          pump();
+          settle();
+        } else if (window.count(s)) {
+          kept = kept && body.size() <= window[s];
+          window[s] -= std::min(window[s], body.size());
+          if (s == up_stream && h.cmd == SOCKS_CONNECT) {
+            uploaded += body.size();
+          }
+          if (s == up_stream && window[s] == 0) {
+            // the session waits for this
+            window[s] = STREAM_WINDOW;
+            put_b4(grant, STREAM_WINDOW);
+            peer.send(STREAM_CREDIT, s, grant, sizeof(grant));
+          }
+        } else if (s == 0 && h.cmd == GET_URL) {
+          // the first answer tells the client what the server has
+          peer.send(OK, 0, fill.data(), 16);
+        }
+        return true;
+      });
+    });
+    // before the others, so it gets the tunnel and stream 0
+    first.connect(local);
+    bool done = run_for(io, std::chrono::seconds(10));
+    if (done && kept && synced && uploaded == upload.size()) {
+      printf("Test 21 OK.\n");
+    } else {
+      printf("Test 21 failed.\n");
+      passed = false;
+    }
+    return passed;
+  }
+
 private:
+  // runs io until something stops it, false if that took longer than limit
+  static bool run_for(asio::io_service &io, std::chrono::seconds limit) {
+    bool late = false;
+    asio::steady_timer timeout(io, limit);
+    timeout.async_wait([&](const boost::system::error_code &ec) {
+      if (!ec) {
+        late = true;
+        io.stop();
+      }
+    });
+    io.run();
+    return !late;
+  }
+
   void do_accept() {
     acceptor_.async_accept(in_socket_, [this](std::error_code ec) {
       if (!ec) {
         // start a new session to do works
-        std::make_shared<tun_client_session>(io_context_, std::move(in_socket_))
+        std::make_shared<tun_client_session>(io_context_, std::move(in_socket_),
+                                             tunnel(), tunnels_)
             ->start();
       }
       // wait for new connections
       do_accept();
     });
   }
+
+  /*
+  The shared tunnel once it streams(), else a private one. Without a live
+  shared tunnel the private one becomes it, and streams() after the server
+  answered its first session with CAP_STREAMS.
+  */
+  std::shared_ptr<tun_client_tunnel> tunnel() {
+    if (shared_ && tunnel_ && tunnel_->alive() && tunnel_->streams()) {
+      return tunnel_;
+    }
+    auto t = warm_ ? warm_->take() : new_tunnel();
+    if (shared_ && !(tunnel_ && tunnel_->alive())) {
+      t->share();
+      tunnel_ = t;
+    }
+    return t;
+  }
+
+  std::shared_ptr<tun_client_tunnel> new_tunnel() {
+    auto t = std::make_shared<tun_client_tunnel>(io_context_, workers_, opts_,
+                                                 tunnels_);
+    t->start();
+    return t;
+  }
+
   asio::io_service &io_context_;
   tcp::acceptor acceptor_;
   tcp::socket in_socket_;
+  worker_pool *workers_;
+  codec_options opts_;
+  tunnel_options tunnels_;
+  bool shared_;
+  std::shared_ptr<tun_client_tunnel> tunnel_;
+  // nullptr unless tunnels are kept warm
+  std::unique_ptr<tunnel_pool> warm_;
 };
 
 } // namespace luke
@@ -1,7 +1,8 @@
 #pragma once
 
 #include "common.hpp"
-#include "crypto.hpp"
+#include "frame.hpp"
+#include "workers.hpp"
 
 namespace luke {
 
@@ -12,9 +13,17 @@ using namespace std;
 class tun_server_session
     : public std::enable_shared_from_this<tun_server_session> {
 public:
-  tun_server_session(asio::io_service &io_context, tcp::socket socket)
+  // the most streams a client opens on one connection besides stream 0,
+  // each may hold a window of backlog
+  enum { MAX_STREAMS = 256 };
+
+  tun_server_session(asio::io_service &io_context, tcp::socket socket,
+                     worker_pool *workers, const codec_options &opts)
       : io_context_(io_context), in_socket_(std::move(socket)),
-        out_socket_(io_context), resolver(io_context), crp("@@abort();") {}
+        out_socket_(io_context), resolver(io_context),
+        codec_("@@abort();", false, opts), offload_(io_context, workers) {
+    streams_[0] = stream_state();
+  }
 
   void start() { handle_request(); }
 
@@ -26,54 +35,131 @@ private:
     cmd b4
     crypto body data len b4
   crypto real body data
+  or the compact form, see frame_codec::encode
   */
   void handle_request() {
+    read_request(frame_codec::HEAD_MIN, [this]() {
+      size_t head_len = frame_codec::head_size(requests_.data());
+      if (head_len == 0) {
+        log_err("Bad header len");
+        return;
+      }
+      // a compact header is all there already
+      read_request(head_len, [this, head_len]() { handle_head(head_len); });
+    });
+  }
+
+  void handle_head(size_t head_len) {
     auto self(shared_from_this());
-    in_data_.resize(2);
-    asio::async_read(
-        in_socket_, asio::buffer(in_data_, 2),
-        [this, self](std::error_code ec, std::size_t length) {
-          if (ec || length != 2) {
-            log_err("Read header len", ec);
+    // decrpyt header
+    offload_.run(
+        [this, self, head_len]() {
+          return codec_.decode_head(requests_.data(), head_len, header_);
+        },
+        [this, self, head_len](bool ok) {
+          if (!ok) {
+            log_err("Bad header");
             return;
           }
-          b2 header_len = get_b2(in_data_, 0);
-          in_data_.resize(header_len);
-          asio::async_read(
-              in_socket_, asio::buffer(in_data_, header_len),
-              [this, self, header_len](std::error_code ec, std::size_t length) {
-                if (ec || length != header_len) {
-                  log_err("Read header data", ec);
-                  return;
-                }
-                // decrpyt header
-                bytes header = crp.decrypt(in_data_);
-                int pos = 0;
-                b4 ver = get_b4(header, pos);
-                pos += 4;
-                b2 cmd = get_b4(header, pos);
-                pos += 4;
-                b4 body_len = get_b4(header, pos);
-                pos += 4;
-                in_data_.resize(body_len);
-                asio::async_read(in_socket_, asio::buffer(in_data_, body_len),
-                                 [this, self, body_len,
-                                  cmd](std::error_code ec, std::size_t length) {
-                                   if (ec || length != body_len) {
-                                     log_err("Read body data", ec);
-                                     return;
-                                   }
-                                   // decrpyt body
-                                   bytes body = crp.decrypt(in_data_);
-                                   handle_command(cmd, body);
-                                 });
-              });
+          requests_.consume(head_len);
+          read_request(header_.body_len, [this]() { handle_body(); });
         });
   }
 
-  void handle_command(b2 cmd, const bytes &body) {
-    // dump_bytes("body", body);
+  void handle_body() {
     auto self(shared_from_this());
+    b4 body_len = header_.body_len;
+    // decrpyt body, in requests_ which is done with it after
+    offload_.run(
+        [this, self, body_len]() {
+          return codec_.decode_body_in_place(header_, requests_.data(),
+                                             body_len, body_);
+        },
+        [this, self, body_len](bool ok) {
+          if (!ok) {
+            log_err("Bad body");
+            return;
+          }
+          requests_.consume(body_len);
+          handle_command(header_.cmd, header_.stream, body_);
+        });
+  }
+
+  // then() once requests_ holds n bytes, reading only if it doesn't yet
+  template <typename Then> void read_request(size_t n, Then then) {
+    if (requests_.size() >= n) {
+      then();
+      return;
+    }
+    auto self(shared_from_this());
+    in_socket_.async_read_some(
+        requests_.prepare(n),
+        [this, self, n, then](std::error_code ec, std::size_t length) {
+          if (ec) {
+            log_err("Read request", ec);
+            return;
+          }
+          requests_.commit(length);
+          read_request(n, then);
+        });
+  }
+
+  // a request on stream, answered on the same stream
+  void handle_command(b2 cmd, b4 stream, const bytes &body) {
+    // dump_bytes("body", body);
+    if (cmd == STREAM_OPEN || cmd == STREAM_CLOSE) {
+      if (cmd == STREAM_CLOSE) {
+        streams_.erase(stream);
+      } else if (streams_.count(stream) == 0 &&
+                 streams_.size() > MAX_STREAMS) {
+        refuse(stream, "Too many streams");
+        return;
+      } else {
+        streams_[stream] = stream_state();
+        streams_[stream].counted = (header_.caps & CAP_CREDITS) != 0;
+      }
+      handle_request();
+      return;
+    }
+    auto it = streams_.find(stream);
+    if (it == streams_.end()) {
+      // a credit may cross the close of its stream
+      if (cmd != STREAM_CREDIT) {
+        log_err("Request on a stream that isn't open");
+      }
+      handle_request();
+      return;
+    }
+    stream_state &s = it->second;
+    if (cmd == STREAM_CREDIT && !s.counted) {
+      if (stream == 0 && (header_.caps & CAP_CREDITS)) {
+        // the client heard our CAP_STREAMS, stream 0 counts from here on
+        // both ways, ours once the client has our answer
+        s.counted = true;
+        s.credit = 0;
+        put_b4(grant_, 0);
+        write_frame(STREAM_CREDIT, grant_, sizeof(grant_), stream,
+                    [this]() { handle_request(); });
+        return;
+      }
+      handle_request();
+      return;
+    }
+    if (cmd == STREAM_CREDIT) {
+      if (body.size() >= 4) {
+        s.credit += get_b4(body.data());
+      }
+      send_backlog(stream, [this]() { handle_request(); });
+      return;
+    }
+    if (s.counted) {
+      if (body.size() > s.window) {
+        refuse(stream, "Stream over its credit");
+        return;
+      }
+      s.window -= body.size();
+      s.ungranted += body.size();
+    }
     if (cmd == GET_URL) {
       // get the url contents, not impl, only for testing
       string urlstr = string_from_bytes(body);
@@ -90,21 +176,96 @@ private:
   </body>
 </html>
 )";
-    in_data_ = make_response(OK, bytes_from_string(content));
-    boost::asio::async_write(
-        in_socket_, boost::asio::buffer(in_data_, in_data_.size()),
-        [this, self](boost::system::error_code ec, std::size_t length) {
-          if (ec) {
-            log_err("Write resp", ec);
-            return;
-          }
-        });
+      if (s.backlog.size() + content.size() > STREAM_WINDOW) {
+        refuse(stream, "Stream backlog over its window");
+        return;
+      }
+      s.backlog.insert(s.backlog.end(), content.begin(), content.end());
+      send_backlog(stream, [this, stream]() {
+        grant(stream, [this]() { handle_request(); });
+      });
     } else if (cmd == SOCKS_CONNECT) {
       // todo
       // handle_response();
+      grant(stream, [this]() { handle_request(); });
     }
   }
 
+  // stream is closed with a STREAM_CLOSE, upon which the client closes its
+  // session, and the others on the connection go on
+  void refuse(b4 stream, const char *why) {
+    log_err(why);
+    streams_.erase(stream);
+    write_frame(STREAM_CLOSE, nullptr, 0, stream,
+                [this]() { handle_request(); });
+  }
+
+  // the most a response frame carries
+  size_t max_frame() const {
+    return (header_.caps & CAP_LARGE_FRAMES) ? size_t(LARGE_FRAME_SIZE)
+                                             : size_t(MAX_BUF_SIZE);
+  }
+
+  // the backlog of stream out as far as its credit goes, then()
+  void send_backlog(b4 stream, std::function<void()> then) {
+    stream_state &s = streams_[stream];
+    size_t n = std::min(s.backlog.size(), max_frame());
+    if (s.counted) {
+      n = std::min(n, s.credit);
+      s.credit -= n;
+    }
+    if (n == 0) {
+      then();
+      return;
+    }
+    // nothing else touches the backlog until the frame is out
+    write_frame(OK, s.backlog.data(), n, stream, [this, stream, n, then]() {
+      bytes &backlog = streams_[stream].backlog;
+      backlog.erase(backlog.begin(), backlog.begin() + n);
+      send_backlog(stream, then);
+    });
+  }
+
+  // once the client sent half a window on stream that is taken, a
+  // STREAM_CREDIT for it, then()
+  void grant(b4 stream, std::function<void()> then) {
+    stream_state &s = streams_[stream];
+    if (!s.counted || s.ungranted < STREAM_WINDOW / 2) {
+      then();
+      return;
+    }
+    put_b4(grant_, (b4)s.ungranted);
+    s.window += s.ungranted;
+    s.ungranted = 0;
+    write_frame(STREAM_CREDIT, grant_, sizeof(grant_), stream, then);
+  }
+
+  // a frame of len bytes from data, which stays put until then()
+  void write_frame(b4 cmd, const b1 *data, size_t len, b4 stream,
+                   std::function<void()> then) {
+    auto self(shared_from_this());
+    offload_.run(
+        [this, self, cmd, data, len, stream]() {
+          return make_response(cmd, data, len, stream);
+        },
+        [this, self, then](const frame_codec::buffers &resp) {
+          auto start = std::chrono::steady_clock::now();
+          boost::asio::async_write(
+              in_socket_, resp,
+              [this, self, start, then](boost::system::error_code ec,
+                                        std::size_t length) {
+                if (ec) {
+                  log_err("Write resp", ec);
+                  return;
+                }
+                codec_.written(in_socket_, length,
+                               std::chrono::steady_clock::now() - start);
+                // the next request may already be in requests_
+                then();
+              });
+        });
+  }
+
   /* response
   crypto header length: 2 bytes
   crypto header data
@@ -112,45 +273,125 @@ private:
     cmd result b4
     crypto body data len b4
   crypto real body data
+  see frame_header for the rest of the header
   */
-  const bytes make_response(b4 cmd_result, const bytes &body_data) {
-    bytes ret;
-    bytes encrpyt_body = crp.encrypt(body_data);
-    bytes header_data;
-    push_b4(header_data, VER);
-    push_b4(header_data, cmd_result);
-    push_b4(header_data, (b4)encrpyt_body.size()); // crypto body size
-    bytes encrpyt_header = crp.encrypt(header_data);
-    push_b2(ret, (b2)encrpyt_header.size()); // header length
-    push_bytes(ret, encrpyt_header);
-    push_bytes(ret, encrpyt_body);
-    return ret;
+  frame_codec::buffers make_response(b4 cmd_result, const b1 *body_data,
+                                     size_t len, b4 stream) {
+    return codec_.encode(cmd_result, body_data, len, stream);
   }
 
   asio::io_service &io_context_;
   tcp::socket in_socket_;
   tcp::socket out_socket_;
   tcp::resolver resolver;
-  bytes in_data_;
+  frame_reader requests_;
   bytes out_data_;
-  luke::crypto crp;
+  bytes body_;
+  frame_codec codec_;
+  // the header being handled, written by decode_header
+  frame_header header_;
+  session_offload offload_;
+  /*
+  What each side may still send on a stream, once it is counted: from its
+  STREAM_OPEN when the client has CAP_CREDITS, and for stream 0 from the
+  client's first STREAM_CREDIT on it. The client sends at most window more
+  bytes, which grows by what a STREAM_CREDIT grants it once ungranted
+  reaches half a window. Responses wait in backlog for the credit the
+  client grants us, and no more than STREAM_WINDOW of them wait, so neither
+  end holds more than a window for a stream the other is slow on.
+  */
+  struct stream_state {
+    bool counted = false;
+    size_t window = STREAM_WINDOW;
+    size_t ungranted = 0;
+    size_t credit = STREAM_WINDOW;
+    bytes backlog;
+  };
+  // the streams the client opened, stream 0 from the start
+  std::unordered_map<b4, stream_state> streams_;
+  // the body of the STREAM_CREDIT going out
+  b1 grant_[4];
 }; // namespace luke
 
 class tun_server {
 public:
-  tun_server(asio::io_service &io_context, short port)
+  // workers may be nullptr, then sessions do their crypto inline. Only
+  // opts.adaptive matters here, the server answers in the client's codec.
+  tun_server(asio::io_service &io_context, short port,
+             worker_pool *workers = nullptr,
+             const codec_options &opts = codec_options())
       : io_context_(io_context),
         acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-        in_socket_(io_context) {
+        in_socket_(io_context), workers_(workers), opts_(opts) {
     do_accept();
   }
 
+  // the port, which port 0 leaves to the system
+  unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+  /*
+  Prints a line for each test, true if all of them passed. Stream 0 counts
+  once the client sends a STREAM_CREDIT on it, then what the server sends
+  keeps to the client's credit. A stream over its window is closed and the
+  next one is still answered.
+  */
+  static bool test() {
+    asio::io_service io;
+    tun_server server(io, 0);
+    test_peer client(io, true);
+    // the cmd, stream and body size of each answer
+    std::vector<std::array<size_t, 3>> got;
+    client.socket().connect(
+        tcp::endpoint(address_v4::loopback(), server.port()));
+    client.start([&](const frame_header &h, const bytes &body) {
+      got.push_back({h.cmd, h.stream, body.size()});
+      if (got.size() < 6) {
+        return true;
+      }
+      io.stop();
+      return false;
+    });
+    bytes url = bytes_from_string("test"), big(STREAM_WINDOW + 1, 'u');
+    b1 credit[4];
+    client.send(GET_URL, 0, url.data(), url.size());
+    put_b4(credit, 0);
+    client.send(STREAM_CREDIT, 0, credit, sizeof(credit));
+    // no credit for it yet, then enough for 5 bytes
+    client.send(GET_URL, 0, url.data(), url.size());
+    put_b4(credit, 5);
+    client.send(STREAM_CREDIT, 0, credit, sizeof(credit));
+    client.send(STREAM_OPEN, 1);
+    client.send(SOCKS_CONNECT, 1, big.data(), big.size());
+    client.send(STREAM_OPEN, 2);
+    client.send(GET_URL, 2, url.data(), url.size());
+    put_b4(credit, STREAM_WINDOW);
+    client.send(STREAM_CREDIT, 0, credit, sizeof(credit));
+    asio::steady_timer timeout(io, std::chrono::seconds(10));
+    timeout.async_wait([&](const boost::system::error_code &ec) {
+      if (!ec) {
+        io.stop();
+      }
+    });
+    io.run();
+    size_t page = got.empty() ? 0 : got[0][2];
+    std::vector<std::array<size_t, 3>> want = {
+        {OK, 0, page},          {STREAM_CREDIT, 0, 4}, {OK, 0, 5},
+        {STREAM_CLOSE, 1, 0},   {OK, 2, page},         {OK, 0, page - 5}};
+    if (page > 5 && got == want) {
+      printf("Test 22 OK.\n");
+      return true;
+    }
+    printf("Test 22 failed.\n");
+    return false;
+  }
+
 private:
   void do_accept() {
     acceptor_.async_accept(in_socket_, [this](std::error_code ec) {
       if (!ec) {
         // start a new session to do works
-        std::make_shared<tun_server_session>(io_context_, std::move(in_socket_))
+        std::make_shared<tun_server_session>(io_context_, std::move(in_socket_),
+                                             workers_, opts_)
             ->start();
       }
       // wait for new connections
@@ -160,6 +401,8 @@ private:
   asio::io_service &io_context_;
   tcp::acceptor acceptor_;
   tcp::socket in_socket_;
+  worker_pool *workers_;
+  codec_options opts_;
 };
 
 } // namespace luke
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "common.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+namespace luke {
+
+/*
+Threads for the zlib and cipher work of the sessions, so one bulk transfer
+doesn't hold up the io_service thread that every other session reads and
+writes on. The sockets stay on the main io_service.
+*/
+class worker_pool {
+public:
+  explicit worker_pool(size_t threads) : work_(service_) {
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back([this]() { service_.run(); });
+    }
+  }
+
+  ~worker_pool() {
+    service_.stop();
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+
+  boost::asio::io_service &service() { return service_; }
+
+private:
+  boost::asio::io_service service_;
+  boost::asio::io_service::work work_;
+  std::vector<std::thread> threads_;
+};
+
+/*
+Where one session runs its frame encode and decode. Without a pool the work
+runs inline. With one it goes through a strand of the pool, so the frames of
+a session are still done one at a time and in order, and only one thread
+touches the session's frame_codec; the result is posted back to the io
+service of the session's sockets.
+*/
+class session_offload {
+public:
+  session_offload(boost::asio::io_service &io, worker_pool *pool)
+      : io_(io) {
+    if (pool != nullptr) {
+      strand_.reset(new boost::asio::io_service::strand(pool->service()));
+    }
+  }
+
+  // done(work()) on the io_service, work and done keep the session alive
+  template <typename Work, typename Done> void run(Work work, Done done) {
+    if (!strand_) {
+      done(work());
+      return;
+    }
+    boost::asio::io_service &io = io_;
+    strand_->post([&io, work, done]() mutable {
+      auto result = work();
+      io.post([done, result]() mutable { done(result); });
+    });
+  }
+
+private:
+  boost::asio::io_service &io_;
+  std::unique_ptr<boost::asio::io_service::strand> strand_;
+};
+
+/*
+Threads that help one caller through a batch of independent jobs, the
+chunks of a large frame, pigz style. The caller works on its batch too and
+takes jobs off the same counter as the helpers, so a batch finishes even
+when every helper is busy with another session's.
+*/
+class chunk_pool {
+public:
+  explicit chunk_pool(size_t threads) {
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~chunk_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+
+  chunk_pool(const chunk_pool &) = delete;
+  chunk_pool &operator=(const chunk_pool &) = delete;
+
+  size_t threads() const { return threads_.size(); }
+
+  // fn(0) .. fn(n - 1) in any order and on any thread, returns once all
+  // are done. fn must not throw.
+  void parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+    if (n == 0) {
+      return;
+    }
+    auto b = std::make_shared<batch>(n, fn);
+    size_t helpers = std::min(n - 1, threads_.size());
+    if (helpers > 0) {
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        queue_.insert(queue_.end(), helpers, b);
+      }
+      cv_.notify_all();
+    }
+    work(*b);
+    std::unique_lock<std::mutex> lock(b->mtx);
+    b->cv.wait(lock, [&b]() { return b->done == b->n; });
+  }
+
+private:
+  struct batch {
+    batch(size_t n, const std::function<void(size_t)> &fn) : n(n), fn(fn) {}
+    const size_t n;
+    // only called for a claimed job, so never once the caller has returned
+    const std::function<void(size_t)> &fn;
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    std::mutex mtx;
+    std::condition_variable cv;
+  };
+
+  static void work(batch &b) {
+    for (size_t i = b.next++; i < b.n; i = b.next++) {
+      b.fn(i);
+      std::lock_guard<std::mutex> lock(b.mtx);
+      if (++b.done == b.n) {
+        b.cv.notify_all();
+      }
+    }
+  }
+
+  void run() {
+    for (;;) {
+      std::shared_ptr<batch> b;
+      {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        b = queue_.front();
+        queue_.pop_front();
+      }
+      work(*b);
+    }
+  }
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  // one entry per helper a batch asked for, a late one finds nothing left
+  std::deque<std::shared_ptr<batch>> queue_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace luke
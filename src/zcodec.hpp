@@ -0,0 +1,587 @@
+#pragma once
+
+#include "common.hpp"
+#include "lz4.hpp"
+#include "workers.hpp"
+#include <atomic>
+#include <limits>
+#include <zlib.h>
+#if defined(__linux__)
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace luke {
+
+/*
+zlib over one z_stream that lives as long as its owner, zlib format and
+defaults. A per frame deflater is reset for every call and finishes each
+frame as a whole zlib stream. A streaming one never resets: every call ends
+with a sync flush, so the peer can inflate the frame as soon as it arrives,
+and later frames reuse the window of the earlier ones.
+*/
+class zlib_deflater {
+public:
+  explicit zlib_deflater(bool streaming) : streaming_(streaming) {}
+
+  ~zlib_deflater() {
+    if (ready_) {
+      deflateEnd(&zs_);
+    }
+  }
+
+  zlib_deflater(const zlib_deflater &) = delete;
+  zlib_deflater &operator=(const zlib_deflater &) = delete;
+
+  // worst case output for len bytes, the deflateBound of default params,
+  // plus the zlib header and sync flush marker of a stream frame
+  static constexpr size_t bound(size_t len) {
+    return len + (len >> 12) + (len >> 14) + (len >> 25) + 13 + 8;
+  }
+
+  // zlib level 1-9 from the next frame on
+  void set_level(int level) { level_ = level; }
+
+  // compress into out, reusing its capacity
+  void deflate_frame(const b1 *data, size_t size, bytes &out) {
+    if (!ready_) {
+      zs_ = z_stream();
+      if (deflateInit(&zs_, level_) != Z_OK) {
+        throw std::runtime_error("deflateInit failed");
+      }
+      ready_ = true;
+      applied_level_ = level_;
+    } else if (!streaming_) {
+      deflateReset(&zs_);
+    }
+    out.resize(bound(size));
+    zs_.next_out = out.data();
+    zs_.avail_out = (uInt)out.size();
+    if (applied_level_ != level_) {
+      // after a reset or a sync flush nothing is pending, so this writes
+      // nothing and the new level starts with this frame
+      zs_.avail_in = 0;
+      if (deflateParams(&zs_, level_, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateParams failed");
+      }
+      applied_level_ = level_;
+    }
+    zs_.next_in = const_cast<Bytef *>(data);
+    zs_.avail_in = (uInt)size;
+    int ret = deflate(&zs_, streaming_ ? Z_SYNC_FLUSH : Z_FINISH);
+    if (streaming_ && ret == Z_BUF_ERROR && size == 0) {
+      // nothing new since the last flush, zlib has nothing to write
+      out.clear();
+      return;
+    }
+    // with avail_out 0 a sync flush may not be complete
+    bool ok = streaming_ ? ret == Z_OK && zs_.avail_out != 0
+                         : ret == Z_STREAM_END;
+    if (!ok || zs_.avail_in != 0) {
+      throw std::runtime_error("deflate failed");
+    }
+    out.resize(out.size() - zs_.avail_out);
+  }
+
+private:
+  z_stream zs_;
+  bool ready_ = false;
+  bool streaming_;
+  int level_ = Z_DEFAULT_COMPRESSION;
+  int applied_level_ = Z_DEFAULT_COMPRESSION;
+};
+
+class zlib_inflater {
+public:
+  explicit zlib_inflater(bool streaming) : streaming_(streaming) {}
+
+  ~zlib_inflater() {
+    if (ready_) {
+      inflateEnd(&zs_);
+    }
+  }
+
+  zlib_inflater(const zlib_inflater &) = delete;
+  zlib_inflater &operator=(const zlib_inflater &) = delete;
+
+  /*
+  decompress into out, reusing its capacity; false on corrupt data or when
+  it holds more than limit bytes. out only grows as far as the frame needs.
+  */
+  bool inflate_frame(const b1 *data, size_t size, bytes &out, size_t limit) {
+    if (!start(data, size)) {
+      out.clear();
+      return false;
+    }
+    // start from what the buffer already holds, frames are alike in size
+    out.resize(std::min(std::max(out.capacity(), size * 4 + 64), limit + 1));
+    size_t have = 0;
+    bool done = false;
+    while (!done) {
+      if (have == out.size()) {
+        if (have > limit) {
+          log_err("inflate over limit");
+          out.clear();
+          return false;
+        }
+        out.resize(std::min(out.size() * 2, limit + 1));
+      }
+      size_t produced;
+      if (!next(out.data() + have, out.size() - have, produced, done)) {
+        out.clear();
+        return false;
+      }
+      have += produced;
+    }
+    if (have > limit) {
+      log_err("inflate over limit");
+      out.clear();
+      return false;
+    }
+    out.resize(have);
+    return true;
+  }
+
+  // decompress into the cap bytes at dst, len says how many it took; false
+  // on corrupt data or when it holds more than cap bytes
+  bool inflate_into(const b1 *data, size_t size, b1 *dst, size_t cap,
+                    size_t &len) {
+    len = 0;
+    if (!start(data, size)) {
+      return false;
+    }
+    for (bool done = false; !done;) {
+      size_t produced;
+      b1 spare;
+      bool full = len == cap;
+      if (!next(full ? &spare : dst + len, full ? 1 : cap - len, produced,
+                done)) {
+        return false;
+      }
+      if (full && produced > 0) {
+        log_err("inflate over limit");
+        return false;
+      }
+      len += produced;
+    }
+    return true;
+  }
+
+  // take a frame to decompress with next()
+  bool start(const b1 *data, size_t size) {
+    if (!ready_) {
+      zs_ = z_stream();
+      if (inflateInit(&zs_) != Z_OK) {
+        throw std::runtime_error("inflateInit failed");
+      }
+      ready_ = true;
+    } else if (!streaming_) {
+      inflateReset(&zs_);
+    }
+    // a stream frame is empty or ends with the sync flush marker
+    static const b1 marker[4] = {0x00, 0x00, 0xFF, 0xFF};
+    if (streaming_ && size > 0 &&
+        (size < 4 || !std::equal(marker, marker + 4, data + size - 4))) {
+      log_err("inflate frame not flushed");
+      return false;
+    }
+    zs_.next_in = const_cast<Bytef *>(data);
+    zs_.avail_in = (uInt)size;
+    return true;
+  }
+
+  /*
+  up to cap more bytes of the frame to dst, produced says how many. done is
+  set once the frame is all out, which can come with 0 bytes. false on
+  corrupt or truncated data.
+  */
+  bool next(b1 *dst, size_t cap, size_t &produced, bool &done) {
+    cap = std::min(cap, (size_t)std::numeric_limits<uInt>::max());
+    zs_.next_out = dst;
+    zs_.avail_out = (uInt)cap;
+    done = false;
+    for (;;) {
+      int ret = inflate(&zs_, streaming_ ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+      produced = cap - zs_.avail_out;
+      if (ret == Z_STREAM_END && !streaming_) {
+        done = true;
+        return true;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        log_err("inflate failed");
+        return false;
+      }
+      if (zs_.avail_out == 0) {
+        // full, there may be more
+        return true;
+      }
+      // a stream frame ends at its sync flush with all input used, anything
+      // else short of the stream end is truncated
+      if (zs_.avail_in == 0) {
+        if (streaming_) {
+          done = true;
+          return true;
+        }
+        log_err("inflate truncated");
+        return false;
+      }
+      if (ret == Z_BUF_ERROR) {
+        log_err("inflate failed");
+        return false;
+      }
+    }
+  }
+
+private:
+  z_stream zs_;
+  bool ready_ = false;
+  bool streaming_;
+};
+
+/*
+LZ4 blocks, one per frame. A block doesn't say how long its data is, so the
+frame is that length as b4 and then the block. Much less CPU than deflate
+for most of its ratio on text.
+*/
+class lz4_codec {
+public:
+  lz4_codec() { LZ4_Init(&ctx_); }
+
+  lz4_codec(const lz4_codec &) = delete;
+  lz4_codec &operator=(const lz4_codec &) = delete;
+
+  static constexpr size_t bound(size_t len) { return 4 + LZ4_Bound(len); }
+
+  // compress into out, reusing its capacity
+  void compress_frame(const b1 *data, size_t size, bytes &out) {
+    out.resize(bound(size));
+    put_b4(out.data(), (b4)size);
+    out.resize(4 + LZ4_Compress_Block(&ctx_, data, size, out.data() + 4));
+  }
+
+  // decompress into out, reusing its capacity; false on corrupt data or
+  // when it holds more than limit bytes
+  static bool decompress_frame(const b1 *data, size_t size, bytes &out,
+                               size_t limit) {
+    out.clear();
+    if (size < 4) {
+      log_err("lz4 frame truncated");
+      return false;
+    }
+    size_t len = get_b4(data);
+    // no block expands more than 255 times, don't allocate for a lie
+    if (len > (size - 4) * 255 || len > limit) {
+      log_err("lz4 frame too long");
+      return false;
+    }
+    out.resize(len);
+    if (!LZ4_Decompress_Block(data + 4, size - 4, out.data(), len)) {
+      log_err("lz4 frame corrupt");
+      out.clear();
+      return false;
+    }
+    return true;
+  }
+
+private:
+  LZ4_CTX ctx_;
+};
+
+/*
+A large body as independent zlib streams of CHUNK input bytes each, so the
+chunks deflate and inflate on as many threads as the chunk_pool has. The
+frame is the chunk count as b4, the compressed size of every chunk as b4,
+then the chunks in order. Every chunk but the last inflates to exactly CHUNK
+bytes, so the decoder knows where each one goes before it starts. Without a
+pool the chunks are done one after another on the calling thread.
+*/
+class zlib_chunks {
+public:
+  // bodies from PARALLEL_MIN bytes on have at least two chunks to share out
+  enum : size_t { CHUNK = 16 * 1024, PARALLEL_MIN = 2 * CHUNK };
+
+  zlib_chunks() = default;
+  zlib_chunks(const zlib_chunks &) = delete;
+  zlib_chunks &operator=(const zlib_chunks &) = delete;
+
+  static constexpr size_t count(size_t len) {
+    return (len + CHUNK - 1) / CHUNK;
+  }
+
+  // the deflate bounds of the chunks and the size table
+  static constexpr size_t bound(size_t len) {
+    return 4 + len + (len >> 12) + (len >> 14) + count(len) * (4 + 13 + 8);
+  }
+
+  chunk_pool *pool() const { return pool_; }
+  void set_pool(chunk_pool *pool) { pool_ = pool; }
+
+  // zlib level 1-9 from the next frame on
+  void set_level(int level) { level_ = level; }
+
+  // compress into out, reusing its capacity
+  void compress_frame(const b1 *data, size_t size, bytes &out) {
+    size_t n = count(size);
+    if (parts_.size() < n) {
+      parts_.resize(n);
+    }
+    int level = level_;
+    std::atomic<bool> failed{false};
+    each(n, [&](size_t i) {
+      // every thread keeps its own z_stream from frame to frame
+      thread_local zlib_deflater z(false);
+      size_t pos = i * CHUNK;
+      try {
+        z.set_level(level);
+        z.deflate_frame(data + pos, std::min<size_t>(CHUNK, size - pos),
+                        parts_[i]);
+      } catch (const std::exception &) {
+        failed = true;
+      }
+    });
+    if (failed) {
+      throw std::runtime_error("deflate failed");
+    }
+    size_t total = 4 + 4 * n;
+    for (size_t i = 0; i < n; i++) {
+      total += parts_[i].size();
+    }
+    out.resize(total);
+    put_b4(out.data(), (b4)n);
+    b1 *p = out.data() + 4 + 4 * n;
+    for (size_t i = 0; i < n; i++) {
+      put_b4(out.data() + 4 + 4 * i, (b4)parts_[i].size());
+      p = std::copy(parts_[i].begin(), parts_[i].end(), p);
+    }
+  }
+
+  // decompress into out, reusing its capacity; false on corrupt data or
+  // when it holds more than limit bytes
+  bool decompress_frame(const b1 *data, size_t size, bytes &out,
+                        size_t limit) {
+    out.clear();
+    size_t n = size < 4 ? 0 : get_b4(data);
+    if (n == 0 && size == 4) {
+      // an empty body has no chunks
+      return true;
+    }
+    if (n == 0 || n > (size - 4) / 4) {
+      log_err("zlib chunks truncated");
+      return false;
+    }
+    if ((n - 1) * CHUNK >= limit) {
+      log_err("inflate over limit");
+      return false;
+    }
+    // where every chunk starts in data
+    offsets_.resize(n + 1);
+    offsets_[0] = 4 + 4 * n;
+    for (size_t i = 0; i < n; i++) {
+      size_t len = get_b4(data + 4 + 4 * i);
+      if (len > size - offsets_[i]) {
+        log_err("zlib chunks truncated");
+        return false;
+      }
+      offsets_[i + 1] = offsets_[i] + len;
+    }
+    if (offsets_[n] != size) {
+      log_err("zlib chunks truncated");
+      return false;
+    }
+    out.resize(std::min<size_t>(n * CHUNK, limit));
+    size_t last = 0;
+    std::atomic<bool> failed{false};
+    each(n, [&](size_t i) {
+      thread_local zlib_inflater z(false);
+      size_t pos = i * CHUNK;
+      size_t cap = std::min<size_t>(CHUNK, out.size() - pos);
+      size_t len;
+      bool ok = z.inflate_into(data + offsets_[i],
+                               offsets_[i + 1] - offsets_[i],
+                               out.data() + pos, cap, len);
+      if (i + 1 < n) {
+        ok = ok && len == CHUNK;
+      } else {
+        last = len;
+        ok = ok && len > 0;
+      }
+      if (!ok) {
+        failed = true;
+      }
+    });
+    if (failed) {
+      log_err("zlib chunks corrupt");
+      out.clear();
+      return false;
+    }
+    out.resize((n - 1) * CHUNK + last);
+    return true;
+  }
+
+private:
+  template <typename Fn> void each(size_t n, Fn fn) {
+    if (pool_ != nullptr) {
+      pool_->parallel_for(n, fn);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        fn(i);
+      }
+    }
+  }
+
+  chunk_pool *pool_ = nullptr;
+  int level_ = Z_DEFAULT_COMPRESSION;
+  std::vector<bytes> parts_;
+  std::vector<size_t> offsets_;
+};
+
+/*
+Whether the next frame is worth compressing. Most of what a tunnel carries
+is TLS already, which deflate only makes bigger, so after a run of frames
+that didn't shrink the frames go out raw, with a compressed probe every so
+often to notice when the traffic changes.
+*/
+class compress_bypass {
+public:
+  // frames smaller than SAMPLE_MIN say little either way
+  enum { SAMPLE_MIN = 256, MISSES = 4, PROBE_EVERY = 16 };
+
+  bool skip() {
+    if (misses_ < MISSES) {
+      return false;
+    }
+    return ++skipped_ % PROBE_EVERY != 0;
+  }
+
+  // a frame of in bytes was compressed to out bytes
+  void record(size_t in, size_t out) {
+    if (in < SAMPLE_MIN) {
+      return;
+    }
+    if (out + in / 16 >= in) {
+      misses_ = std::min(misses_ + 1, (int)MISSES);
+    } else {
+      misses_ = 0;
+      skipped_ = 0;
+    }
+  }
+
+private:
+  int misses_ = 0;
+  int skipped_ = 0;
+};
+
+/*
+How hard a session compresses, as a rung from LZ4 (0) through zlib levels
+1-9. Every WINDOW frames it weighs the CPU time spent on an input byte
+against the time the link took to carry what that byte became: when the CPU
+is the slower of the two it steps down, and when the link is SPARE times
+slower it steps up. Link times come from the io thread, the rest from
+whichever thread encodes.
+*/
+class level_controller {
+public:
+  enum { LZ4_RUNG = 0, DEFAULT_RUNG = 6, MAX_RUNG = 9, WINDOW = 16 };
+  enum { SPARE = 4 };
+
+  explicit level_controller(int rung) : rung_(rung) {}
+
+  int rung() const { return rung_; }
+
+  // a frame of in bytes became out bytes in secs
+  void compressed(size_t in, size_t out, double secs) {
+    in_ += in;
+    out_ += out;
+    cpu_secs_ += secs;
+    frames_++;
+  }
+
+  // the link carried bytes in ns
+  void drained(size_t bytes, b8 ns) {
+    wire_bytes_ += bytes;
+    wire_ns_ += ns;
+  }
+
+  // at the end of a window, moves the rung and starts the next one
+  void adjust() {
+    if (frames_ < WINDOW || in_ == 0) {
+      return;
+    }
+    b8 wire_bytes = wire_bytes_.exchange(0);
+    b8 wire_ns = wire_ns_.exchange(0);
+    if (wire_bytes > 0 && wire_ns > 0) {
+      double cpu_per_byte = cpu_secs_ / in_;
+      double link_per_byte = wire_ns * 1e-9 / wire_bytes * out_ / in_;
+      if (cpu_per_byte > link_per_byte && rung_ > LZ4_RUNG) {
+        rung_--;
+      } else if (cpu_per_byte * SPARE < link_per_byte && rung_ < MAX_RUNG) {
+        rung_++;
+      }
+    }
+    in_ = out_ = 0;
+    cpu_secs_ = 0;
+    frames_ = 0;
+  }
+
+private:
+  int rung_;
+  size_t in_ = 0;
+  size_t out_ = 0;
+  double cpu_secs_ = 0;
+  int frames_ = 0;
+  std::atomic<b8> wire_bytes_{0};
+  std::atomic<b8> wire_ns_{0};
+};
+
+/*
+How fast the link drains a socket. A write completes once its bytes are in
+the kernel's send buffer, so its time is mostly that of the copy. Where the
+kernel tells how much it holds that the peer hasn't acknowledged (SIOCOUTQ
+on Linux), the bytes acknowledged between two completed writes over the
+time between them is what the link carried. A span that starts with an
+empty queue is skipped, the link may have idled in it. Elsewhere the write
+time is all there is, which overstates the link speed while the send buffer
+has room.
+*/
+class link_meter {
+public:
+  // a write of bytes to socket finished after ns, on the io thread
+  template <class Socket>
+  void written(Socket &socket, size_t bytes, b8 ns, level_controller &ctl) {
+    b8 queued;
+    if (!send_queue(socket, queued)) {
+      ctl.drained(bytes, ns);
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (queued_ > 0) {
+      b8 acked = queued_ + bytes > queued ? queued_ + bytes - queued : 0;
+      ctl.drained(acked, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             now - since_)
+                             .count());
+    }
+    queued_ = queued;
+    since_ = now;
+  }
+
+private:
+  // the bytes the kernel holds for socket that the peer hasn't acknowledged
+  template <class Socket> static bool send_queue(Socket &socket, b8 &queued) {
+#if defined(__linux__) && defined(SIOCOUTQ)
+    int n = 0;
+    if (ioctl(socket.native_handle(), SIOCOUTQ, &n) == 0 && n >= 0) {
+      queued = n;
+      return true;
+    }
+#else
+    (void)socket;
+#endif
+    (void)queued;
+    return false;
+  }
+
+  b8 queued_ = 0;
+  std::chrono::steady_clock::time_point since_;
+};
+
+} // namespace luke